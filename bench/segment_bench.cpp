@@ -0,0 +1,431 @@
+//
+// SegmentMap micro benchmark, 与std::unordered_map, absl::flat_hash_map对比
+//
+// 参数: slot数量 / 装载率(%) / 阶数量
+//  ./segment_bench --benchmark_filter=FindHit
+//  ./segment_bench --benchmark_out=bench.json --benchmark_out_format=json
+//
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#ifdef HAVE_ABSL_FLAT_HASH_MAP
+#include <absl/container/flat_hash_map.h>
+#endif
+
+#include "../src/segment_map.hpp"
+#include "../src/segment_set.hpp"
+#include "../src/segment_frozen.hpp"
+#include "../src/segment_coro.hpp"
+
+namespace {
+
+struct BenchValue {
+    uint64_t key;
+    uint64_t payload;
+
+    BenchValue() : key(0), payload(0) {}
+    BenchValue(uint64_t k, uint64_t p) : key(k), payload(p) {}
+
+    uint64_t getKey() const { return key; }
+    void setKey(uint64_t k) { key = k; }
+};
+
+// 统一各个容器的接口
+struct SegmentMapAdapter {
+    typedef SegmentMap<uint64_t, BenchValue> map_type;
+
+    SegmentMapAdapter(size_t capacity, int stage) : map(capacity, stage) {}
+
+    bool insert(const BenchValue &v) { return map.insert_new(v).second; }
+    void update(const BenchValue &v) { map.insert_or_update(v); }
+    bool contains(uint64_t key) { return map.find(key) != map.end(); }
+    bool erase(uint64_t key) { return map.erase(key); }
+    void clear() { map.clear(); }
+
+    uint64_t sum() {
+        uint64_t s = 0;
+        for (map_type::iterator it = map.begin(); it != map.end(); ++it) s += it->payload;
+        return s;
+    }
+
+    map_type map;
+};
+
+template <typename Map>
+struct StdMapAdapter {
+    StdMapAdapter(size_t capacity, int /* stage */) { map.reserve(capacity); }
+
+    bool insert(const BenchValue &v) { return map.emplace(v.key, v).second; }
+    void update(const BenchValue &v) { map[v.key] = v; }
+    bool contains(uint64_t key) { return map.find(key) != map.end(); }
+    bool erase(uint64_t key) { return map.erase(key) != 0; }
+    void clear() { map.clear(); }
+
+    uint64_t sum() {
+        uint64_t s = 0;
+        for (typename Map::const_iterator it = map.begin(); it != map.end(); ++it)
+            s += it->second.payload;
+        return s;
+    }
+
+    Map map;
+};
+
+typedef StdMapAdapter<std::unordered_map<uint64_t, BenchValue> > UnorderedMapAdapter;
+#ifdef HAVE_ABSL_FLAT_HASH_MAP
+typedef StdMapAdapter<absl::flat_hash_map<uint64_t, BenchValue> > FlatHashMapAdapter;
+#endif
+
+std::vector<uint64_t> random_keys(size_t n, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<uint64_t> keys(n);
+    for (size_t i = 0; i < n; ++i) {
+        do {
+            keys[i] = rng() >> 1;
+        } while (keys[i] == 0);  // NIL_KEY
+    }
+    return keys;
+}
+
+// 按照装载率填充容器, 返回成功插入的key
+template <typename Adapter>
+std::vector<uint64_t> fill(Adapter &m, size_t capacity, int load_percent) {
+    const size_t target = capacity * load_percent / 100;
+    std::vector<uint64_t> candidates = random_keys(capacity, 1);
+    std::vector<uint64_t> keys;
+    keys.reserve(target);
+    for (size_t i = 0; i < candidates.size() && keys.size() < target; ++i) {
+        if (m.insert(BenchValue(candidates[i], i))) keys.push_back(candidates[i]);
+    }
+    return keys;
+}
+
+struct Fixture {
+    Fixture(const benchmark::State &state)
+        : capacity(state.range(0)), load(state.range(1)), stage(state.range(2)) {}
+
+    size_t capacity;
+    int load;
+    int stage;
+};
+
+void set_counters(benchmark::State &state, size_t filled, size_t capacity) {
+    state.counters["fill_rate"] = (double)filled / capacity;
+}
+
+template <typename Adapter>
+void BM_FindHit(benchmark::State &state) {
+    Fixture f(state);
+    Adapter m(f.capacity, f.stage);
+    std::vector<uint64_t> keys = fill(m, f.capacity, f.load);
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64(2));
+
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(m.contains(keys[i]));
+        if (++i == keys.size()) i = 0;
+    }
+    state.SetItemsProcessed(state.iterations());
+    set_counters(state, keys.size(), f.capacity);
+}
+
+template <typename Adapter>
+void BM_FindMiss(benchmark::State &state) {
+    Fixture f(state);
+    Adapter m(f.capacity, f.stage);
+    std::vector<uint64_t> keys = fill(m, f.capacity, f.load);
+    std::vector<uint64_t> misses = random_keys(f.capacity, 3);
+
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(m.contains(misses[i]));
+        if (++i == misses.size()) i = 0;
+    }
+    state.SetItemsProcessed(state.iterations());
+    set_counters(state, keys.size(), f.capacity);
+}
+
+template <typename Adapter>
+void BM_InsertNew(benchmark::State &state) {
+    Fixture f(state);
+    Adapter m(f.capacity, f.stage);
+    std::vector<uint64_t> keys = fill(m, f.capacity, f.load);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        m.clear();
+        state.ResumeTiming();
+        for (size_t i = 0; i < keys.size(); ++i) {
+            benchmark::DoNotOptimize(m.insert(BenchValue(keys[i], i)));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+    set_counters(state, keys.size(), f.capacity);
+}
+
+template <typename Adapter>
+void BM_InsertOrUpdate(benchmark::State &state) {
+    Fixture f(state);
+    Adapter m(f.capacity, f.stage);
+    std::vector<uint64_t> keys = fill(m, f.capacity, f.load);
+
+    size_t i = 0;
+    uint64_t n = 0;
+    for (auto _ : state) {
+        m.update(BenchValue(keys[i], ++n));
+        if (++i == keys.size()) i = 0;
+    }
+    state.SetItemsProcessed(state.iterations());
+    set_counters(state, keys.size(), f.capacity);
+}
+
+template <typename Adapter>
+void BM_Erase(benchmark::State &state) {
+    Fixture f(state);
+    Adapter m(f.capacity, f.stage);
+    std::vector<uint64_t> keys = fill(m, f.capacity, f.load);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        for (size_t i = 0; i < keys.size(); ++i) m.insert(BenchValue(keys[i], i));
+        state.ResumeTiming();
+        for (size_t i = 0; i < keys.size(); ++i) {
+            benchmark::DoNotOptimize(m.erase(keys[i]));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+    set_counters(state, keys.size(), f.capacity);
+}
+
+template <typename Adapter>
+void BM_Iterate(benchmark::State &state) {
+    Fixture f(state);
+    Adapter m(f.capacity, f.stage);
+    std::vector<uint64_t> keys = fill(m, f.capacity, f.load);
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(m.sum());
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+    set_counters(state, keys.size(), f.capacity);
+}
+
+template <typename Adapter>
+void BM_Clear(benchmark::State &state) {
+    Fixture f(state);
+    Adapter m(f.capacity, f.stage);
+    std::vector<uint64_t> keys = fill(m, f.capacity, f.load);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        for (size_t i = 0; i < keys.size(); ++i) m.insert(BenchValue(keys[i], i));
+        state.ResumeTiming();
+        m.clear();
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+    set_counters(state, keys.size(), f.capacity);
+}
+
+// slot数量从L1(16B * 1K)到远大于LLC(16B * 4M)
+const int64_t kCapacities[] = {1 << 10, 1 << 14, 1 << 18, 1 << 22};
+const int64_t kLoads[] = {50, 80};
+const int64_t kStages[] = {8, 20, 40};
+
+// 只注册可以分出stage个素数大小阶的组合, 例如1K slot无法分为20阶
+void SegmentArgs(benchmark::internal::Benchmark *b) {
+    b->ArgNames({"slots", "load", "stage"});
+    SegmentBucket buckets[SegmentMapAdapter::map_type::MAX_SEGMENT_CNT];
+    for (int64_t c : kCapacities)
+        for (int64_t l : kLoads)
+            for (int64_t s : kStages) {
+                if (init_segment_buckets(c, s, buckets) != 0) b->Args({c, l, s});
+            }
+}
+
+// 对比容器没有阶的概念
+void BaselineArgs(benchmark::internal::Benchmark *b) {
+    b->ArgNames({"slots", "load", "stage"});
+    for (int64_t c : kCapacities)
+        for (int64_t l : kLoads) b->Args({c, l, 0});
+}
+
+// key-only set: 记录型SegmentSet逐个查找 对比 CompactSegmentSet批量查找
+template <typename Set>
+void BM_SetContains(benchmark::State &state) {
+    const size_t capacity = state.range(0);
+    Set set(capacity, 20);
+    std::vector<uint64_t> keys = random_keys(capacity * 8 / 10, 5);
+    for (size_t i = 0; i < keys.size(); ++i) set.insert(BenchValue(keys[i], 0));
+    std::vector<uint64_t> probes = random_keys(4096, 6);
+    for (size_t i = 0; i < probes.size(); i += 2) probes[i] = keys[i % keys.size()];
+
+    for (auto _ : state) {
+        size_t n = 0;
+        for (size_t i = 0; i < probes.size(); ++i) n += set.count(probes[i]);
+        benchmark::DoNotOptimize(n);
+    }
+    state.SetItemsProcessed(state.iterations() * probes.size());
+}
+
+// 批量查找: contains_batch(按表大小选择预取或SIMD) 对比 总是使用SIMD多key探测
+template <typename Slot, bool SIMD>
+void BM_CompactContainsBatch(benchmark::State &state) {
+    const size_t capacity = state.range(0);
+    CompactSegmentSet<uint64_t, 0, Slot> set(capacity, 20);
+    std::vector<uint64_t> keys = random_keys(capacity * 8 / 10, 5);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        keys[i] = (Slot)keys[i] | 1;
+        set.insert(keys[i]);
+    }
+    // 一半命中, 一半在Slot范围内不命中
+    std::vector<uint64_t> probes = random_keys(4096, 6);
+    for (size_t i = 0; i < probes.size(); ++i)
+        probes[i] = i % 2 ? ((Slot)probes[i] | 1) : keys[i % keys.size()];
+    std::unique_ptr<bool[]> out(new bool[probes.size()]);
+
+    for (auto _ : state) {
+        if (SIMD)
+            set.contains_batch_simd(probes.data(), probes.size(), out.get());
+        else
+            set.contains_batch(probes.data(), probes.size(), out.get());
+        benchmark::DoNotOptimize(out.get());
+    }
+    state.SetItemsProcessed(state.iterations() * probes.size());
+    state.counters["bytes"] = set.memory_size();
+}
+
+// 单个key查找: 标量find 对比 SIMD多阶探测
+template <bool SIMD>
+void BM_CompactFind(benchmark::State &state) {
+    const size_t capacity = state.range(0);
+    CompactSegmentSet<uint64_t, 0, uint32_t> set(capacity, state.range(1));
+    std::vector<uint64_t> keys = random_keys(capacity * 8 / 10, 5);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        keys[i] = (uint32_t)keys[i] | 1;
+        set.insert(keys[i]);
+    }
+    std::vector<uint64_t> probes = random_keys(4096, 6);
+    for (size_t i = 0; i < probes.size(); ++i)
+        probes[i] = i % 2 ? ((uint32_t)probes[i] | 1) : keys[i % keys.size()];
+
+    for (auto _ : state) {
+        size_t n = 0;
+        for (size_t i = 0; i < probes.size(); ++i)
+            n += SIMD ? set.contains_simd(probes[i]) : set.contains(probes[i]);
+        benchmark::DoNotOptimize(n);
+    }
+    state.SetItemsProcessed(state.iterations() * probes.size());
+}
+
+// 冻结后的只读表 vs 原表, 装载率80%, 20阶
+template <bool FROZEN>
+void BM_FrozenFind(benchmark::State &state) {
+    const size_t capacity = state.range(0);
+    SegmentMapAdapter m(capacity, 20);
+    std::vector<uint64_t> keys = fill(m, capacity, 80);
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64(2));
+    FrozenSegmentMap<uint64_t, BenchValue> frozen;
+    if (FROZEN) frozen = freeze(m.map);
+
+    size_t i = 0;
+    for (auto _ : state) {
+        if (FROZEN)
+            benchmark::DoNotOptimize(frozen.find(keys[i]));
+        else
+            benchmark::DoNotOptimize(m.contains(keys[i]));
+        if (++i == keys.size()) i = 0;
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["bytes_per_key"] =
+        FROZEN ? (double)frozen.memory_size() / keys.size()
+               : (double)m.map.max_size() * sizeof(BenchValue) / keys.size();
+}
+
+#ifdef HASHTABLE_SEGMENT_CORO_HPP_ENABLED
+// 协程交错查找: range(1)个常驻的handler, 每个handler依次查找自己的key, 对比逐个find
+segment_coro::Task<> coro_handler(segment_coro::Scheduler &sched,
+                                  SegmentMapAdapter::map_type &map,
+                                  const std::vector<uint64_t> &keys, size_t first,
+                                  size_t step, size_t &found) {
+    for (size_t i = first; i < keys.size(); i += step) {
+        SegmentMapAdapter::map_type::iterator it =
+            co_await segment_coro::find_async(sched, map, keys[i]);
+        found += it != map.end();
+    }
+}
+
+void BM_CoroFind(benchmark::State &state) {
+    const size_t capacity = state.range(0);
+    const size_t handlers = state.range(1);
+    SegmentMapAdapter m(capacity, 20);
+    std::vector<uint64_t> keys = fill(m, capacity, 80);
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64(2));
+    // 探测的key覆盖的slot超过L2, 每次查找都需要访问更远的cache或内存
+    keys.resize(std::min<size_t>(keys.size(), 1 << 16));
+
+    size_t found = 0;
+    for (auto _ : state) {
+        if (handlers == 0) {
+            for (size_t i = 0; i < keys.size(); ++i) found += m.contains(keys[i]);
+            continue;
+        }
+
+        segment_coro::Scheduler sched;
+        for (size_t i = 0; i < handlers; ++i)
+            sched.spawn(coro_handler(sched, m.map, keys, i, handlers, found));
+        sched.run();
+    }
+    benchmark::DoNotOptimize(found);
+    state.SetItemsProcessed(state.iterations() * keys.size());
+}
+#endif
+
+}  // namespace
+
+#define SEGMENT_BENCHMARK(fn)                                                    \
+    BENCHMARK_TEMPLATE(fn, SegmentMapAdapter)->Apply(SegmentArgs);              \
+    BENCHMARK_TEMPLATE(fn, UnorderedMapAdapter)->Apply(BaselineArgs)
+
+#ifdef HAVE_ABSL_FLAT_HASH_MAP
+#define BASELINE_BENCHMARK(fn) \
+    BENCHMARK_TEMPLATE(fn, FlatHashMapAdapter)->Apply(BaselineArgs)
+#else
+#define BASELINE_BENCHMARK(fn)
+#endif
+
+SEGMENT_BENCHMARK(BM_FindHit);
+BASELINE_BENCHMARK(BM_FindHit);
+SEGMENT_BENCHMARK(BM_FindMiss);
+BASELINE_BENCHMARK(BM_FindMiss);
+SEGMENT_BENCHMARK(BM_InsertNew);
+BASELINE_BENCHMARK(BM_InsertNew);
+SEGMENT_BENCHMARK(BM_InsertOrUpdate);
+BASELINE_BENCHMARK(BM_InsertOrUpdate);
+SEGMENT_BENCHMARK(BM_Erase);
+BASELINE_BENCHMARK(BM_Erase);
+SEGMENT_BENCHMARK(BM_Iterate);
+BASELINE_BENCHMARK(BM_Iterate);
+SEGMENT_BENCHMARK(BM_Clear);
+BASELINE_BENCHMARK(BM_Clear);
+
+BENCHMARK_TEMPLATE(BM_SetContains, SegmentSet<uint64_t, 0, BenchValue>)->Range(1 << 14, 1 << 22);
+BENCHMARK_TEMPLATE(BM_CompactContainsBatch, uint64_t, false)->Range(1 << 14, 1 << 22);
+BENCHMARK_TEMPLATE(BM_CompactContainsBatch, uint32_t, false)->RangeMultiplier(2)->Range(1 << 12, 1 << 22);
+BENCHMARK_TEMPLATE(BM_CompactContainsBatch, uint32_t, true)->RangeMultiplier(2)->Range(1 << 12, 1 << 22);
+BENCHMARK_TEMPLATE(BM_CompactFind, false)->ArgsProduct({{1 << 14, 1 << 18, 1 << 22}, {8, 20, 40}});
+BENCHMARK_TEMPLATE(BM_CompactFind, true)->ArgsProduct({{1 << 14, 1 << 18, 1 << 22}, {8, 20, 40}});
+
+BENCHMARK_TEMPLATE(BM_FrozenFind, false)->Range(1 << 16, 1 << 22);
+BENCHMARK_TEMPLATE(BM_FrozenFind, true)->Range(1 << 16, 1 << 22);
+#ifdef HASHTABLE_SEGMENT_CORO_HPP_ENABLED
+// handlers为0表示逐个find
+BENCHMARK(BM_CoroFind)->ArgNames({"slots", "handlers"})->ArgsProduct({{1 << 16, 1 << 22}, {0, 8, 32}});
+#endif
+
+BENCHMARK_MAIN();
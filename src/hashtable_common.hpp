@@ -23,8 +23,10 @@ static inline bool is_prime_num(size_t n) {
     return true;
 }
 
-//得到小于n的最大素数
+//得到小于n的最大素数, n <= 2时没有这样的素数, 返回0
 static inline size_t find_perv_prime(size_t n) {
+    if (n <= 2) return 0;
+
     for (--n; n > 0; --n) {
         if (is_prime_num(n)) return n;
     }
@@ -32,4 +34,115 @@ static inline size_t find_perv_prime(size_t n) {
     return 0;
 }
 
+//32位取模的乘数, 见 Lemire "Faster Remainder by Direct Computation"
+static inline uint64_t fastmod_magic(uint32_t d) {
+    return UINT64_MAX / d + 1;
+}
+
+//a % d, magic = fastmod_magic(d)
+static inline uint32_t fastmod_u32(uint32_t a, uint64_t magic, uint32_t d) {
+    uint64_t low = magic * a;
+    return (uint32_t)(((__uint128_t)low * d) >> 64);
+}
+
+// murmur3 fmix64, 把相关的key打散到整个64位空间
+static inline uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+//把64位hash映射到[0, n), 使用乘法代替取模, 只使用hash的高位
+static inline size_t fastrange64(uint64_t h, size_t n) {
+    return (size_t)(((__uint128_t)h * n) >> 64);
+}
+
+/**
+ * 计算各阶下标前对key的变换, 下标为 hash(key, stage) % size + offset.
+ * PER_STAGE为0时各阶使用同一个hash值, 只计算一次.
+ * ID和SEED标识slot的布局, 记录在delta文件中, 自定义策略需要使用不同的ID
+ */
+namespace segment_hash {
+
+//直接使用key. 连续或者等间隔的key在素数取模下本身分布均匀
+struct identity {
+    enum { PER_STAGE = 0, ID = 0 };
+    static const uint64_t SEED = 0;
+
+    template <typename Key>
+    static Key hash(Key key, size_t /* stage */) { return key; }
+};
+
+// murmur3 finalizer, key的结构与各阶大小相关时使用
+struct murmur {
+    enum { PER_STAGE = 0, ID = 1 };
+    static const uint64_t SEED = 0;
+
+    template <typename Key>
+    static uint64_t hash(Key key, size_t /* stage */) { return mix64((uint64_t)key); }
+};
+
+//每阶使用不同种子的 multiply-xorshift, 在一阶冲突的key在其他阶不相关
+struct seeded {
+    enum { PER_STAGE = 1, ID = 2 };
+    static const uint64_t SEED = 0xd1b54a32d192ed03ULL;
+
+    template <typename Key>
+    static uint64_t hash(Key key, size_t stage) {
+        uint64_t h = ((uint64_t)key + (stage + 1) * SEED) *
+                     0x9e3779b97f4a7c15ULL;
+        return h ^ (h >> 32);
+    }
+};
+
+}  // namespace segment_hash
+
+//每一阶的大小和在slot数组中的偏移值
+struct SegmentBucket {
+    //TODO 根据slot数量自动选择是uint16_t 还是uint32_t
+    uint32_t size;
+    uint32_t offset;
+};
+
+//计算每一阶的大小和偏移
+// xxxxxxxxxxxxxxxxxx
+// xxxxxxxxxxxxxxx
+// xxxxxxxxxxx
+// xxxxx
+//每一阶的大小为素数,数量依次递减,
+//目前使用素数序列，
+// TODO
+//数量的选择采用等比数列 减少的系数为1.3
+//@return 所有阶的slot总数, <= slot_count.
+//         slot_count不足以分出stage个素数大小的阶时返回0, 此时buckets的内容无效
+static inline size_t init_segment_buckets(size_t slot_count, size_t stage,
+                                          SegmentBucket *buckets) {
+    if (stage == 0) return 0;
+
+    size_t used = 0;
+    size_t size = slot_count / stage;
+    for (size_t i = 1; i < stage; ++i) {
+        size = find_perv_prime(size);
+        if (size == 0) return 0;
+        buckets[i].size = size;
+        used += size;
+    }
+    size = slot_count - used;
+    size = find_perv_prime(size);
+    if (size == 0) return 0;
+    buckets[0].size = size;
+
+    // clc offset
+    used = 0;
+    for (size_t i = 0; i < stage; ++i) {
+        buckets[i].offset = used;
+        used += buckets[i].size;
+    }
+
+    return used;
+}
+
 #endif //HASHTABLE_HASHTABLE_COMMON_HPP
@@ -0,0 +1,357 @@
+///@doc SegmentMap 协程查找
+///find_async预取slot后让出执行, 多个查找的cache miss可以重叠.
+///需要C++20
+
+#ifndef HASHTABLE_SEGMENT_CORO_HPP
+#define HASHTABLE_SEGMENT_CORO_HPP
+
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<coroutine>)
+
+#define HASHTABLE_SEGMENT_CORO_HPP_ENABLED 1
+
+#include <stddef.h>
+#include <coroutine>
+#include <exception>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace segment_coro {
+
+template <typename T>
+class Task;
+
+namespace detail {
+
+/**
+ * 协程帧的线程内缓存, 避免每次查找都调用malloc.
+ * 按64字节分级, 超过MAX_SIZE的帧直接使用operator new
+ */
+class FrameCache {
+ public:
+  enum { ALIGN = 64, MAX_SIZE = 1024, CLASS_COUNT = MAX_SIZE / ALIGN };
+
+  static void *alloc(size_t size) {
+    if (size > MAX_SIZE) return ::operator new(size);
+
+    FreeNode *&head = local()._free[(size - 1) / ALIGN];
+    if (head == NULL) return ::operator new(((size - 1) / ALIGN + 1) * ALIGN);
+
+    FreeNode *n = head;
+    head = n->next;
+    return n;
+  }
+
+  static void free(void *p, size_t size) {
+    if (size > MAX_SIZE) {
+      ::operator delete(p);
+      return;
+    }
+
+    FreeNode *n = static_cast<FreeNode *>(p);
+    FreeNode *&head = local()._free[(size - 1) / ALIGN];
+    n->next = head;
+    head = n;
+  }
+
+ private:
+  struct FreeNode {
+    FreeNode *next;
+  };
+
+  FrameCache() : _free() {}
+
+  ~FrameCache() {
+    for (size_t i = 0; i < CLASS_COUNT; ++i) {
+      while (_free[i]) {
+        FreeNode *n = _free[i];
+        _free[i] = n->next;
+        ::operator delete(n);
+      }
+    }
+  }
+
+  static FrameCache &local() {
+    static thread_local FrameCache cache;
+    return cache;
+  }
+
+  FreeNode *_free[CLASS_COUNT];
+};
+
+template <typename T>
+struct PromiseBase {
+  std::coroutine_handle<> continuation;
+  std::exception_ptr exception;
+
+  static void *operator new(size_t size) { return FrameCache::alloc(size); }
+  static void operator delete(void *p, size_t size) { FrameCache::free(p, size); }
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  //结束时切换回等待者, 顶层任务返回调度器
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+
+    template <typename P>
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<P> h) noexcept {
+      std::coroutine_handle<> c = h.promise().continuation;
+      return c ? c : std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+  };
+
+  FinalAwaiter final_suspend() noexcept { return {}; }
+
+  void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template <typename T>
+struct Promise : PromiseBase<T> {
+  std::optional<T> value;
+
+  Task<T> get_return_object();
+  void return_value(T v) { value.emplace(std::move(v)); }
+};
+
+template <>
+struct Promise<void> : PromiseBase<void> {
+  Task<void> get_return_object();
+  void return_void() {}
+};
+
+}  // namespace detail
+
+/**
+ * 惰性启动的协程任务, co_await时开始执行, 完成后恢复等待者
+ */
+template <typename T = void>
+class Task {
+ public:
+  typedef detail::Promise<T> promise_type;
+  typedef std::coroutine_handle<promise_type> handle_type;
+
+  explicit Task(handle_type h) : _h(h) {}
+  Task(Task &&o) noexcept : _h(std::exchange(o._h, nullptr)) {}
+  ~Task() {
+    if (_h) _h.destroy();
+  }
+
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+
+  bool done() const { return !_h || _h.done(); }
+
+  handle_type handle() const { return _h; }
+
+  bool await_ready() const noexcept { return false; }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiter) {
+    _h.promise().continuation = waiter;
+    return _h;
+  }
+
+  T await_resume() {
+    if (_h.promise().exception) std::rethrow_exception(_h.promise().exception);
+    if constexpr (!std::is_void<T>::value) return std::move(*_h.promise().value);
+  }
+
+ private:
+  handle_type _h;
+};
+
+namespace detail {
+
+template <typename T>
+Task<T> Promise<T>::get_return_object() {
+  return Task<T>(std::coroutine_handle<Promise<T> >::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() {
+  return Task<void>(std::coroutine_handle<Promise<void> >::from_promise(*this));
+}
+
+}  // namespace detail
+
+/**
+ * 单线程轮转调度器. 协程预取后yield回到队尾, 先执行其他协程.
+ * 队列中的每一项是一个步骤: 恢复一个协程, 或者执行awaiter的下一步(不需要协程帧)
+ * NOT MT-safe
+ */
+class Scheduler {
+ public:
+  typedef void (*StepFn)(void *arg);
+
+  Scheduler() : _ready(16), _head(0), _tail(0) {}
+
+  /**
+   * 让出执行, 回到队尾等待下次调度
+   */
+  struct YieldAwaiter {
+    Scheduler *sched;
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> h) { sched->post(h); }
+
+    void await_resume() const noexcept {}
+  };
+
+  YieldAwaiter yield() { return YieldAwaiter{this}; }
+
+  /**
+   * 添加一个顶层任务, run()时执行. 任务中的异常会被忽略
+   */
+  void spawn(Task<void> task) {
+    post(task.handle());
+    _tasks.push_back(std::move(task));
+  }
+
+  // 在队尾恢复协程h
+  void post(std::coroutine_handle<> h) { post(&_resume, h.address()); }
+
+  // 在队尾执行fn(arg)
+  void post(StepFn fn, void *arg) {
+    if (_tail - _head == _ready.size()) _grow();
+    Step &s = _ready[_tail++ & (_ready.size() - 1)];
+    s.fn = fn;
+    s.arg = arg;
+  }
+
+  /**
+   * 执行直到所有任务完成
+   */
+  void run() {
+    while (_head != _tail) {
+      Step s = _ready[_head++ & (_ready.size() - 1)];
+      s.fn(s.arg);
+    }
+    _tasks.clear();
+  }
+
+ private:
+  struct Step {
+    StepFn fn;
+    void *arg;
+  };
+
+  static void _resume(void *address) {
+    std::coroutine_handle<>::from_address(address).resume();
+  }
+
+  // 队列满时容量翻倍, 容量保持2的幂
+  void _grow() {
+    std::vector<Step> ready(_ready.size() * 2);
+    for (size_t i = _head; i != _tail; ++i)
+      ready[i - _head] = _ready[i & (_ready.size() - 1)];
+    _tail -= _head;
+    _head = 0;
+    _ready.swap(ready);
+  }
+
+  std::vector<Step> _ready;  //环形队列, 下标对容量取模
+  size_t _head;
+  size_t _tail;
+  std::vector<Task<void> > _tasks;
+};
+
+/**
+ * find_async返回的awaitable, 不分配协程帧.
+ * 每一步预取接下来PREFETCH_STAGES阶的slot后回到调度队列, 下次调度时比较,
+ * 没有找到时继续预取后面的阶, 直到找到或者所有阶都比较完, 然后恢复等待的协程.
+ * 每次只有预取过的slot会被读取, 所有阶的cache miss都可以与其他查找重叠.
+ * 删除会在阶中间留下空slot, 所以遇到空slot不能提前结束
+ */
+template <typename Map>
+class FindAwaiter {
+ public:
+  static constexpr size_t PREFETCH_STAGES = 4;
+
+  typedef typename Map::key_type key_type;
+  typedef typename Map::iterator iterator;
+
+  FindAwaiter(Scheduler &sched, Map &map, const key_type key)
+      : _sched(sched), _map(map), _key(key), _stage(0), _end(0), _result(map.end()) {}
+
+  bool await_ready() {
+    if (_key == Map::nil_key())  // unlikely
+      return true;
+
+    _prefetch();
+    return false;
+  }
+
+  void await_suspend(std::coroutine_handle<> h) {
+    _waiter = h;
+    _sched.post(&FindAwaiter::_step, this);
+  }
+
+  iterator await_resume() { return _result; }
+
+ private:
+  // 由调度器调用, awaiter在等待的协程帧中, 恢复之前一直有效
+  static void _step(void *arg) {
+    FindAwaiter *self = static_cast<FindAwaiter *>(arg);
+    if (self->_compare()) {
+      self->_waiter.resume();
+      return;
+    }
+
+    self->_prefetch();
+    self->_sched.post(&FindAwaiter::_step, self);
+  }
+
+  void _prefetch() {
+    _end = _stage + PREFETCH_STAGES < _map.stage() ? _stage + PREFETCH_STAGES
+                                                   : _map.stage();
+    for (size_t i = _stage; i < _end; ++i) {
+      _index[i - _stage] = _map.slot_index(_key, i);
+      __builtin_prefetch(&_map.slot(_index[i - _stage]));
+    }
+  }
+
+  // 比较预取过的阶, 查找结束时返回true
+  bool _compare() {
+    for (size_t i = _stage; i < _end; ++i) {
+      if (_map.slot(_index[i - _stage]).getKey() == _key) {
+        _result = iterator(&_map, _index[i - _stage]);
+        return true;
+      }
+    }
+
+    _stage = _end;
+    return _stage == _map.stage();
+  }
+
+  Scheduler &_sched;
+  Map &_map;
+  const key_type _key;
+  std::coroutine_handle<> _waiter;
+  size_t _stage;  //预取的第一阶
+  size_t _end;    //预取的最后一阶+1
+  size_t _index[PREFETCH_STAGES];
+  iterator _result;
+};
+
+/**
+ * 协程版本的find, 结果与Map::find相同.
+ * 用法: auto it = co_await find_async(sched, map, key);
+ * @param Map SegmentMap
+ */
+template <typename Map>
+FindAwaiter<Map> find_async(Scheduler &sched, Map &map,
+                            const typename Map::key_type key) {
+  return FindAwaiter<Map>(sched, map, key);
+}
+
+}  // namespace segment_coro
+
+#endif  // __has_include(<coroutine>)
+#endif  // C++20
+
+#endif  // HASHTABLE_SEGMENT_CORO_HPP
@@ -0,0 +1,197 @@
+///@doc SegmentMap 脏slot跟踪, 用于增量checkpoint和备机同步
+///按chunk(连续的2^n个slot)记录修改, 导出时只输出修改过的chunk
+
+#ifndef HASHTABLE_SEGMENT_DIRTY_HPP
+#define HASHTABLE_SEGMENT_DIRTY_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <type_traits>
+#include <vector>
+
+namespace segment_dirty {
+
+/**
+ * 每个chunk一个bit. 未开启时words为空, mark只有一次判断的开销.
+ * bit已经置位时不写内存, 否则使用原子或, 多个线程同时mark(upsert_add_atomic)时不会丢失标记.
+ * 原子操作只保护标记本身: export_dirty读取slot时不能与写操作同时进行, 否则导出的T可能不完整.
+ * 作为SegmentMap的Tracker策略开启变更跟踪:
+ *   SegmentMap<Key, T, NIL_KEY, Hash, segment_dirty::DirtyBitmap>
+ */
+class DirtyBitmap {
+ public:
+  DirtyBitmap() : _shift(0), _slots(0) {}
+
+  bool enabled() const { return !_words.empty(); }
+
+  size_t chunk_slots() const { return (size_t)1 << _shift; }
+
+  size_t chunk_count() const {
+    return _slots ? ((_slots - 1) >> _shift) + 1 : 0;
+  }
+
+  /**
+   * @param slots slot总数
+   * @param chunk_slots 每个chunk的slot数量, 向上取整为2的幂
+   * 开启后所有chunk都标记为脏, 第一次导出即为全量
+   */
+  void enable(size_t slots, size_t chunk_slots) {
+    _shift = 0;
+    while (((size_t)1 << _shift) < chunk_slots) ++_shift;
+    _slots = slots;
+    _words.assign((chunk_count() + 63) / 64, 0);
+    mark_all();
+  }
+
+  void disable() {
+    std::vector<uint64_t>().swap(_words);
+    _slots = 0;
+  }
+
+  // 容器重新初始化后调用, 已开启时按新的slot数量重新开启
+  void resize(size_t slots) {
+    if (enabled()) enable(slots, chunk_slots());
+  }
+
+  void mark(size_t index) {
+    if (_words.empty()) return;
+    const size_t c = index >> _shift;
+    const uint64_t bit = (uint64_t)1 << (c & 63);
+    uint64_t *w = &_words[c >> 6];
+    if (!(__atomic_load_n(w, __ATOMIC_RELAXED) & bit))
+      __atomic_fetch_or(w, bit, __ATOMIC_RELAXED);
+  }
+
+  void mark_all() {
+    const size_t n = chunk_count();
+    for (size_t c = 0; c < n; ++c) _words[c >> 6] |= (uint64_t)1 << (c & 63);
+  }
+
+  /**
+   * 依次取出脏chunk并清除标记
+   * @param fn void fn(size_t first, size_t count); 对应slot区间[first, first+count)
+   * @return 脏chunk数量
+   */
+  template <typename Fn>
+  size_t drain(Fn fn) {
+    size_t n = 0;
+    for (size_t w = 0; w < _words.size(); ++w) {
+      if (!__atomic_load_n(&_words[w], __ATOMIC_RELAXED)) continue;
+      uint64_t bits = __atomic_exchange_n(&_words[w], 0, __ATOMIC_RELAXED);
+      while (bits) {
+        const size_t c = w * 64 + __builtin_ctzll(bits);
+        bits &= bits - 1;
+
+        const size_t first = c << _shift;
+        const size_t last = first + chunk_slots();
+        fn(first, (last < _slots ? last : _slots) - first);
+        ++n;
+      }
+    }
+    return n;
+  }
+
+ private:
+  size_t _shift;
+  size_t _slots;
+  std::vector<uint64_t> _words;
+};
+
+/**
+ * delta文件格式:
+ *   DeltaHeader
+ *   { uint64_t first; uint64_t count; T slots[count]; } * chunks
+ * slot的位置由max_size, stage和Hash策略共同决定, 都相同时才能应用
+ */
+struct DeltaHeader {
+  uint32_t magic;
+  uint32_t slot_bytes;
+  uint64_t max_size;
+  uint64_t stage;
+  uint64_t hash_id;    // Map::hasher::ID
+  uint64_t hash_seed;  // Map::hasher::SEED
+  uint64_t chunks;
+};
+
+enum { DELTA_MAGIC = 0x32444753 };  // "SGD2"
+
+/**
+ * 导出map中的脏chunk到文件, 并清除脏标记. T必须是trivially copyable
+ * @return 写入的chunk数量, 写入失败返回-1(脏标记已经被清除, 需要重新全量导出)
+ */
+template <typename Map>
+long write_delta(Map &map, FILE *fp) {
+  typedef typename Map::value_type T;
+  typedef typename Map::hasher Hash;
+  static_assert(std::is_trivially_copyable<T>::value,
+                "delta file requires trivially copyable value_type");
+
+  DeltaHeader h = {DELTA_MAGIC, (uint32_t)sizeof(T), map.max_size(), map.stage(),
+                   Hash::ID, Hash::SEED, 0};
+  const long begin = ftell(fp);
+  if (fwrite(&h, sizeof(h), 1, fp) != 1) return -1;
+
+  bool ok = true;
+  h.chunks = map.export_dirty([fp, &ok](size_t first, const T *slots,
+                                        size_t count) {
+    uint64_t r[2] = {first, count};
+    ok = ok && fwrite(r, sizeof(r), 1, fp) == 1 &&
+         fwrite(slots, sizeof(T), count, fp) == count;
+  });
+  if (!ok) return -1;
+
+  // 回填chunk数量
+  const long end = ftell(fp);
+  if (fseek(fp, begin, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, fp) != 1 ||
+      fseek(fp, end, SEEK_SET) != 0)
+    return -1;
+  return (long)h.chunks;
+}
+
+/**
+ * 把write_delta写出的文件应用到布局(slot数量, 阶数量, Hash策略)相同的map上.
+ * 先读取并检查所有chunk, 全部有效后才修改map, 需要与delta大小相同的内存.
+ * @return 应用的chunk数量.
+ *         文件格式或布局不匹配, 或者文件被截断返回-1, 此时map没有被修改, 文件位置不确定
+ */
+template <typename Map>
+long read_delta(Map &map, FILE *fp) {
+  typedef typename Map::value_type T;
+  typedef typename Map::hasher Hash;
+  static_assert(std::is_trivially_copyable<T>::value,
+                "delta file requires trivially copyable value_type");
+
+  DeltaHeader h;
+  if (fread(&h, sizeof(h), 1, fp) != 1) return -1;
+  if (h.magic != DELTA_MAGIC || h.slot_bytes != sizeof(T) ||
+      h.max_size != map.max_size() || h.stage != map.stage() ||
+      h.hash_id != (uint64_t)Hash::ID || h.hash_seed != Hash::SEED)
+    return -1;
+
+  // 每个chunk的(first, count), slot连续存放在buf中
+  std::vector<uint64_t> ranges;
+  std::vector<T> buf;
+  for (uint64_t i = 0; i < h.chunks; ++i) {
+    uint64_t r[2];
+    if (fread(r, sizeof(r), 1, fp) != 1) return -1;
+    if (r[0] > h.max_size || r[1] > h.max_size - r[0]) return -1;
+
+    const size_t offset = buf.size();
+    buf.resize(offset + r[1]);
+    if (fread(buf.data() + offset, sizeof(T), r[1], fp) != r[1]) return -1;
+    ranges.push_back(r[0]);
+    ranges.push_back(r[1]);
+  }
+
+  const T *slots = buf.data();
+  for (size_t i = 0; i < ranges.size(); i += 2) {
+    map.apply_slots(ranges[i], slots, ranges[i + 1]);
+    slots += ranges[i + 1];
+  }
+  return (long)h.chunks;
+}
+
+}  // namespace segment_dirty
+
+#endif  // HASHTABLE_SEGMENT_DIRTY_HPP
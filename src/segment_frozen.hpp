@@ -0,0 +1,289 @@
+///@doc SegmentMap/SegmentSet 冻结后的只读表
+///构建完成后只读的表使用最小完美hash重新排列, 没有空slot, find只探测一次
+
+#ifndef HASHTABLE_SEGMENT_FROZEN_HPP
+#define HASHTABLE_SEGMENT_FROZEN_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "segment_map.hpp"
+#include "segment_set.hpp"
+
+namespace segment_frozen {
+
+/**
+ * 最小完美hash (PTHash的简化版本).
+ * key先按hash分到n/LAMBDA个桶中, 每个桶找一个pilot,
+ * 使桶内所有key的位置 fastrange64(mix64(h ^ pilot), n) 都没有被占用.
+ * 从大桶开始放置, 最后剩下的都是只有一个key的桶, 总能找到空位.
+ * 查找时读一次pilot(每个key约1字节), 计算出唯一的位置
+ */
+class PerfectHash {
+ public:
+  enum { LAMBDA = 4 };
+
+  PerfectHash() : _n(0), _seed(0) {}
+
+  size_t size() const { return _n; }
+
+  size_t memory_size() const { return _pilots.size() * sizeof(uint32_t); }
+
+  size_t operator()(uint64_t key) const {
+    assert(!_pilots.empty());
+    const uint64_t h = mix64(key ^ _seed);
+    return _position(h, _pilots[fastrange64(h, _pilots.size())]);
+  }
+
+  /**
+   * @param keys 不能有重复的key
+   * @return 成功返回true. 失败(例如有重复的key)返回false, 此时为空表
+   */
+  bool build(const std::vector<uint64_t> &keys) {
+    _n = keys.size();
+    _pilots.assign(_n / LAMBDA + 1, 0);
+
+    for (_seed = 0; _seed < 16; ++_seed) {
+      if (_try_build(keys)) return true;
+    }
+
+    _n = 0;
+    _seed = 0;
+    _pilots.clear();
+    return false;
+  }
+
+ private:
+  size_t _position(uint64_t h, uint32_t pilot) const {
+    return fastrange64(mix64(h ^ ((uint64_t)pilot * 0x9e3779b97f4a7c15ULL)), _n);
+  }
+
+  bool _try_build(const std::vector<uint64_t> &keys) {
+    const size_t m = _pilots.size();
+    std::vector<uint64_t> hashes(_n);
+    std::vector<size_t> bucket_begin(m + 1, 0);
+    for (size_t i = 0; i < _n; ++i) {
+      hashes[i] = mix64(keys[i] ^ _seed);
+      ++bucket_begin[fastrange64(hashes[i], m) + 1];
+    }
+    for (size_t b = 0; b < m; ++b) bucket_begin[b + 1] += bucket_begin[b];
+
+    // 按桶排列hash
+    std::vector<uint64_t> sorted(_n);
+    std::vector<size_t> fill(bucket_begin.begin(), bucket_begin.end() - 1);
+    size_t max_bucket = 0;
+    for (size_t i = 0; i < _n; ++i) {
+      const size_t b = fastrange64(hashes[i], m);
+      sorted[fill[b]++] = hashes[i];
+      const size_t len = bucket_begin[b + 1] - bucket_begin[b];
+      if (len > max_bucket) max_bucket = len;
+    }
+
+    // 按桶大小从大到小排序
+    std::vector<size_t> by_size_begin(max_bucket + 2, 0);
+    for (size_t b = 0; b < m; ++b)
+      ++by_size_begin[max_bucket - (bucket_begin[b + 1] - bucket_begin[b]) + 1];
+    for (size_t s = 0; s <= max_bucket; ++s) by_size_begin[s + 1] += by_size_begin[s];
+    std::vector<size_t> order(m);
+    for (size_t b = 0; b < m; ++b)
+      order[by_size_begin[max_bucket - (bucket_begin[b + 1] - bucket_begin[b])]++] = b;
+
+    std::vector<bool> taken(_n, false);
+    std::vector<size_t> pos(max_bucket);
+    for (size_t i = 0; i < m; ++i) {
+      const size_t b = order[i];
+      const uint64_t *h = sorted.data() + bucket_begin[b];
+      const size_t len = bucket_begin[b + 1] - bucket_begin[b];
+      if (len == 0) break;
+
+      // hash相同的key在任何pilot下位置都相同
+      for (size_t k = 1; k < len; ++k) {
+        for (size_t j = 0; j < k; ++j) {
+          if (h[j] == h[k]) return false;
+        }
+      }
+
+      uint32_t pilot = 0;
+      for (;; ++pilot) {
+        size_t k = 0;
+        for (; k < len; ++k) {
+          pos[k] = _position(h[k], pilot);
+          if (taken[pos[k]]) break;
+
+          size_t j = 0;
+          while (j < k && pos[j] != pos[k]) ++j;
+          if (j < k) break;
+        }
+        if (k == len) break;
+        if (pilot == UINT32_MAX) return false;
+      }
+
+      _pilots[b] = pilot;
+      for (size_t k = 0; k < len; ++k) taken[pos[k]] = true;
+    }
+
+    return true;
+  }
+
+  size_t _n;
+  uint64_t _seed;
+  std::vector<uint32_t> _pilots;
+};
+
+}  // namespace segment_frozen
+
+/**
+ * 只读的map, 由freeze()生成.
+ * 元素连续存储没有空slot, find为一次pilot读取加一次slot读取.
+ * 构建后不可修改, 多线程并发读取不需要同步.
+ * 构建失败(例如有重复的key)时为空表, valid()返回false
+ *
+ * @param GetKeyFn 同SegmentSet, 默认调用T::getKey()
+ */
+template <typename Key, typename T,
+          typename GetKeyFn = segment_set_get_key<Key, T> >
+class FrozenSegmentMap {
+ public:
+  typedef Key key_type;
+  typedef T value_type;
+  typedef const T *iterator;
+  typedef const T *const_iterator;
+
+  FrozenSegmentMap() : _valid(true) {}
+
+  /**
+   * @param first,last T的序列, key不能重复
+   */
+  template <typename InputIt>
+  FrozenSegmentMap(InputIt first, InputIt last) {
+    std::vector<T> values;
+    std::vector<uint64_t> keys;
+    for (; first != last; ++first) {
+      values.push_back(*first);
+      keys.push_back((uint64_t)GetKeyFn()(values.back()));
+    }
+
+    _valid = _hash.build(keys);
+    if (!_valid) return;
+
+    _slots.resize(values.size());
+    for (size_t i = 0; i < values.size(); ++i)
+      _slots[_hash(keys[i])] = std::move(values[i]);
+  }
+
+  const_iterator begin() const { return _slots.data(); }
+
+  const_iterator end() const { return _slots.data() + _slots.size(); }
+
+  // 构建是否成功
+  bool valid() const { return _valid; }
+
+  bool empty() const { return _slots.empty(); }
+
+  size_t size() const { return _slots.size(); }
+
+  // slot数组和pilot数组占用的字节数
+  size_t memory_size() const {
+    return _slots.size() * sizeof(T) + _hash.memory_size();
+  }
+
+  /**
+   * @return 元素指针, 不存在时返回end()
+   */
+  const_iterator find(const Key key) const {
+    if (_slots.empty()) return end();
+
+    const T *p = _slots.data() + _hash((uint64_t)key);
+    return GetKeyFn()(*p) == key ? p : end();
+  }
+
+  bool contains(const Key key) const { return find(key) != end(); }
+
+  size_t count(const Key key) const { return contains(key) ? 1 : 0; }
+
+ private:
+  segment_frozen::PerfectHash _hash;
+  std::vector<T> _slots;
+  bool _valid;
+};
+
+/**
+ * 只读的key集合, 由CompactSegmentSet freeze生成. 每个key只占一个Slot.
+ * 构建失败时同FrozenSegmentMap
+ */
+template <typename Key, typename Slot = Key>
+class FrozenSegmentSet {
+  static_assert(std::is_integral<Key>::value && std::is_integral<Slot>::value,
+                "FrozenSegmentSet need integral key");
+
+ public:
+  typedef Key key_type;
+
+  FrozenSegmentSet() : _valid(true) {}
+
+  template <typename InputIt>
+  FrozenSegmentSet(InputIt first, InputIt last) {
+    std::vector<uint64_t> keys;
+    for (; first != last; ++first) keys.push_back((uint64_t)(Key)*first);
+
+    _valid = _hash.build(keys);
+    if (!_valid) return;
+
+    _slots.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) _slots[_hash(keys[i])] = (Slot)keys[i];
+  }
+
+  bool valid() const { return _valid; }
+
+  bool empty() const { return _slots.empty(); }
+
+  size_t size() const { return _slots.size(); }
+
+  size_t memory_size() const {
+    return _slots.size() * sizeof(Slot) + _hash.memory_size();
+  }
+
+  bool contains(const Key key) const {
+    if (_slots.empty() || (Key)(Slot)key != key) return false;
+    return _slots[_hash((uint64_t)key)] == (Slot)key;
+  }
+
+  size_t count(const Key key) const { return contains(key) ? 1 : 0; }
+
+  // 遍历所有key, 顺序由hash决定
+  const Slot *begin() const { return _slots.data(); }
+
+  const Slot *end() const { return _slots.data() + _slots.size(); }
+
+ private:
+  segment_frozen::PerfectHash _hash;
+  std::vector<Slot> _slots;
+  bool _valid;
+};
+
+/**
+ * 把已经填充好的表转换为只读表, 原表不会修改
+ */
+template <typename Key, typename T, Key NIL_KEY, typename Hash, typename Tracker,
+          typename Storage>
+FrozenSegmentMap<Key, T> freeze(SegmentMap<Key, T, NIL_KEY, Hash, Tracker, Storage> &map) {
+  return FrozenSegmentMap<Key, T>(map.begin(), map.end());
+}
+
+template <typename Key, Key NIL_KEY, typename T, typename GetKeyFn, typename Hash>
+typename std::enable_if<!std::is_same<Key, T>::value,
+                        FrozenSegmentMap<Key, T, GetKeyFn> >::type
+freeze(SegmentSet<Key, NIL_KEY, T, GetKeyFn, Hash> &set) {
+  return FrozenSegmentMap<Key, T, GetKeyFn>(set.begin(), set.end());
+}
+
+template <typename Key, Key NIL_KEY, typename Slot, typename Hash>
+FrozenSegmentSet<Key, Slot> freeze(const CompactSegmentSet<Key, NIL_KEY, Slot, Hash> &set) {
+  return FrozenSegmentSet<Key, Slot>(set.begin(), set.end());
+}
+
+#endif  // HASHTABLE_SEGMENT_FROZEN_HPP
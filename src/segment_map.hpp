@@ -5,9 +5,50 @@
 #define HASHTABLE_SEGMENT_MAP_HPP
 
 #include <stddef.h>
+#include <assert.h>
+#include <algorithm>
 #include <limits>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
 #include <utility>
 
+#include "hashtable_common.hpp"
+
+//定义SEGMENT_MAP_LATENCY_STATS开启操作延迟统计, 见segment_stats.hpp
+#ifdef SEGMENT_MAP_LATENCY_STATS
+#include "segment_stats.hpp"
+#define SEGMENT_MAP_LATENCY(op) \
+  segment_stats::LatencyScope _latency_scope(segment_stats::op)
+#else
+#define SEGMENT_MAP_LATENCY(op)
+#endif
+
+/**
+ * SegmentMap可选功能的策略. SegmentMap私有继承策略类, 默认策略都是空类, 不增加容器大小.
+ * Tracker: 修改slot后调用mark(index), 重新初始化后调用resize(slot数量).
+ *          使用segment_dirty::DirtyBitmap开启变更跟踪, 见segment_dirty.hpp
+ * Storage: allocate<T>(n)/release<T>(p)分配和释放slot数组.
+ *          使用segment_tier::TieredStorage开启冷热分层存储, 见segment_tier.hpp
+ */
+namespace segment_policy {
+
+//不跟踪修改
+struct no_tracking {
+  void mark(size_t /* index */) {}
+  void resize(size_t /* slots */) {}
+};
+
+//普通内存
+struct heap_storage {
+  template <typename T>
+  T *allocate(size_t n) { return new T[n]; }
+
+  template <typename T>
+  void release(T *p) { delete[] p; }
+};
+
+}  // namespace segment_policy
 
 /**
  * 容器的内存结构是连续的.
@@ -20,37 +61,57 @@
  * @param Key 建类型
  * @param T 值类型
  * @param 代表空键的值，用于无对象标记
+ * @param Hash 计算各阶下标前对key的变换, 见segment_hash. 默认直接使用key
+ * @param Tracker 修改跟踪策略, 见segment_policy. 默认不跟踪
+ * @param Storage slot数组的存储策略, 见segment_policy. 默认使用普通内存
  */
 
 template <typename Key,
           typename T,
-          Key NUL_KEY=Key()
+          Key NIL_KEY=Key(),
+          typename Hash=segment_hash::identity,
+          typename Tracker=segment_policy::no_tracking,
+          typename Storage=segment_policy::heap_storage
          >
-class SegmentMap
+class SegmentMap : private Tracker, private Storage
 {
+  typedef SegmentMap container_type;
+  typedef decltype(Hash::hash(Key(), 0)) hash_type;
+
  public:
   // member types like STL
   typedef Key key_type;
   typedef T value_type;
+  typedef Hash hasher;
 
  public:
   enum { npos = -1 };
+  enum { MAX_SEGMENT_CNT = 64 };
 
  public:
   /**
   * @param KEY_TYPE key类型,必须为整形数值类型
   * @param T 值类型 1. T必须是 POD 类型，Copyable !!!. 如果不是后果自负
+  *                    右值版本的insert/emplace只要求Movable
   *                 2. 有默认构造函数,默认构造的对象getKey 必须返回NIL_KEY
   *                 3. 必须实现 (Conecpt)
   *                    a. KEY_TYPE getKey() const
   *                    b. void setKey(KEY_TYPE key) 方法
   *
-  * @param MAP_SIZE 存储元素的上线. 实际的最大存储数量<= MAP_SIZE
-  * @param STAGE
+  * @param slot_count 存储元素的上线. 实际的最大存储数量<= slot_count
+  * @param segment_count
   * 阶数量，一般在20~50，数量越大利用率越高，但是查找速度越慢.反之依然.
+  * 最大为MAX_SEGMENT_CNT
   * @param NIL_KEY 被认为是空元素的Key值。元素的key不能为NIL_KEY
+  * @throw std::invalid_argument slot_count不足以分出segment_count个素数大小的阶
   */
-  SegmentMap(size_t slot_count, int segment_count) { init(); }
+  SegmentMap(size_t slot_count, int segment_count)
+      : _stage(segment_count), _map_size(slot_count), _bucket_slots(NULL) {
+    if (init() != 0)
+      throw std::invalid_argument("SegmentMap: too few slots for segment_count");
+  }
+
+  ~SegmentMap() { _release_slots(); }
 
  private:
   SegmentMap(const SegmentMap &);
@@ -62,6 +123,7 @@ class SegmentMap
     _Iter(container_type *c, size_t index) : _continer(c), _index(index) {}
 
     _Iter &operator++(void) {
+      SEGMENT_MAP_LATENCY(OP_ITERATE);
       for (size_t i = _index + 1; i < _continer->_max_size; ++i) {
         if (_continer->_bucket_slots[i].getKey() != NIL_KEY) {
           _index = i;
@@ -74,24 +136,20 @@ class SegmentMap
     }
 
     _Iter operator++(int) {
+      SEGMENT_MAP_LATENCY(OP_ITERATE);
       size_t old_index = _index;
       for (size_t i = _index + 1; i < _continer->_max_size; ++i) {
         if (_continer->_bucket_slots[i].getKey() != NIL_KEY) {
           _index = i;
-          return _Iter(this, old_index);
+          return _Iter(_continer, old_index);
         }
       }
 
       _index = npos;
-      return _Iter(this, old_index);
+      return _Iter(_continer, old_index);
     }
 
-    void erase() {
-      if (_continer->bitmap.test(_index)) {
-        _continer->bitmap.reset(_index);
-        --_continer->_used_size;
-      }
-    }
+    void erase() { _continer->erase(*this); }
 
     T &operator*() { return _continer->_bucket_slots[_index]; }
 
@@ -117,6 +175,7 @@ class SegmentMap
   typedef _Iter iterator;
   // iterator
   iterator begin() {
+    SEGMENT_MAP_LATENCY(OP_ITERATE);
     if (empty()) return end();
 
     // find first
@@ -129,9 +188,11 @@ class SegmentMap
 
   iterator end() { return _Iter(this, npos); }
 
-  iterator end() const { return _Iter(this, npos); }
+  iterator end() const {
+    return _Iter(const_cast<container_type *>(this), npos);
+  }
 
-  size_t stage() const { return STAGE; }
+  size_t stage() const { return _stage; }
 
   bool empty() const { return _used_size == 0; }
 
@@ -144,6 +205,27 @@ class SegmentMap
    */
   float used_rate() const { return (float)_used_size / _max_size; }
 
+  /**
+   * 返回slot下标所在的阶, 0为第一阶. 即找到该元素需要的探测次数-1
+   */
+  size_t stage_of(size_t index) const {
+    size_t i = _stage - 1;
+    while (i > 0 && _buckets[i].offset > index) --i;
+    return i;
+  }
+
+  /**
+   * 返回key在第stage阶的slot下标, 用于分步查找(预取后再比较)
+   */
+  size_t slot_index(const Key key, size_t stage) const {
+    return (Hash::hash(key, stage) % _buckets[stage].size) +
+           _buckets[stage].offset;
+  }
+
+  const T &slot(size_t index) const { return _bucket_slots[index]; }
+
+  static Key nil_key() { return NIL_KEY; }
+
  public:
   // modifiers
 
@@ -153,9 +235,16 @@ class SegmentMap
    * clear the contents. same as STL map.clear()
    */
   void clear() {
+    SEGMENT_MAP_LATENCY(OP_CLEAR);
+    if (empty()) return;
+
     // ScopeWLock lock(&_buckets[STAGE-1]._rwlock);
-    for (_Iter it = begin(); it != end(); ++it) {
-      it->setKey((Key)NIL_KEY);
+    // 直接遍历slot, 不通过iterator, 避免重复记录OP_ITERATE
+    for (size_t i = 0; i < _max_size; ++i) {
+      if (_bucket_slots[i].getKey() != NIL_KEY) {
+        _bucket_slots[i].setKey((Key)NIL_KEY);
+        _tracker().mark(i);
+      }
     }
     _used_size = 0;
   }
@@ -167,25 +256,15 @@ class SegmentMap
    * @return 返回元素迭代器，如果不存在返回end()
    */
   iterator find(const Key key) {
-    if (key == NIL_KEY)  // unlikely
-      return end();
-
-    size_t index = npos;
-    for (size_t i = 0; i < STAGE; ++i) {
-      index = (key % _buckets[i].size) + _buckets[i].offset;
-      if (_bucket_slots[index].getKey() == key) {
-        return iterator(this, index);
-      }
-    }
-
-    return end();
+    SEGMENT_MAP_LATENCY(OP_FIND);
+    return iterator(this, _find(key));
   }
 
   /**
    * same STL map.count
    */
   size_t count(const Key key) {
-    if (find(key).index() != npos)
+    if (_find(key) != (size_t)npos)
       return 1;
     else
       return 0;
@@ -200,104 +279,240 @@ class SegmentMap
    * 3. 插入成功，返回（新元素的下标，true)
    *
    */
-  std::pair<iterator, bool> insert_new(const T &v) {
-    const Key key = v.getKey();
+  std::pair<iterator, bool> insert_new(const T &v) { return _insert_new(v); }
+
+  // 右值版本, 元素被move到slot中
+  std::pair<iterator, bool> insert_new(T &&v) {
+    return _insert_new(std::move(v));
+  }
 
+  /**
+   * 直接在空slot上构造元素, 只有找到空slot后才会构造T,
+   * 构造完成后会调用setKey(key).
+   * @return 同insert_new, 元素已经存在时不会构造T
+   */
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(const Key key, Args &&... args) {
+    SEGMENT_MAP_LATENCY(OP_INSERT_NEW);
     if (key == NIL_KEY)  // unlikely
       return {end(), false};
 
-    size_t index = npos;
-    for (size_t i = 0; i < STAGE; ++i) {
-      index = (key % _buckets[i].size) + _buckets[i].offset;
-      // ScopeWLock lock(&_buckets[i]._rwlock);
-      Key slotKey = _bucket_slots[index].getKey();
-      if (slotKey != NIL_KEY) {
-        if (slotKey == key)  // find same element
-          return {iterator(this, index), false};
+    std::pair<size_t, bool> r = _probe(key);
+    if (r.first == (size_t)npos)  // no empty space insert
+      return {end(), false};
 
-#ifdef TEST_SegmentMap
-        ++_find_count;
-#endif
-        continue;  // not same
-      }
+    if (r.second)  // find same element
+      return {iterator(this, r.first), false};
 
-      // find empty slot insert
-      _bucket_slots[index] = v;
-      ++_used_size;
+    _construct(r.first, std::forward<Args>(args)...);
+    _bucket_slots[r.first].setKey(key);
+    _tracker().mark(r.first);
+    ++_used_size;
 
-      return {iterator(this, index), true};
-    }
+    return {iterator(this, r.first), true};
+  }
 
-    // no empty space insert
-    return {end(), false};
+  /**
+   * 用args构造一个T, 再move到空slot中. 已知key时优先使用try_emplace
+   * @return 同insert_new
+   */
+  template <typename... Args>
+  std::pair<iterator, bool> emplace(Args &&... args) {
+    return _insert_new(T(std::forward<Args>(args)...));
   }
 
   /**
-   * inser a element,
-   * 如果无法插入则会通过选择函数找到一个替换的元素进行替换,一定会插入成功.
-   * 一般用于实现淘汰插入.
-   * 元素的key不能为NIL_KEY,
-   * @param fn 替代选择函数 bool fn(const T&l, const T&r);
-   *  当无法插入时，会把所有与插入对象位置冲突的元素进行调用，在这些元素中选择一个最适合替换的进行淘汰，
-   *  接受两个与插入元素冲突的元素,返回true表示第一次对象被淘汰，false表示第二个对象被淘汰.
-   * @note 插入元素不会与冲突元素进行比较，这样保证插入元素肯定会被插入
-   * @param [out] replaced 不为NULL时，返回被替换的对象;
-   * @return 返回元素在内存中的索引，和是否进行了替换
+   * 原地修改元素, 避免find后再拷贝整个T进行insert_or_update.
+   * @param fn void fn(T &v); fn不能修改元素的key
+   * @return 元素不存在时返回false
    */
-  // TODO test
   template <typename Fn>
-  std::pair<iterator, bool> insert_or_replace(const T &v, Fn fn,
-                                              T *replaced = NULL /* out */) {
-    const Key key = v.getKey();
+  bool modify(const Key key, Fn fn) {
+    size_t index = _find(key);
+    if (index == (size_t)npos) return false;
+
+    fn(_bucket_slots[index]);
+    _tracker().mark(index);
+    return true;
+  }
 
+  /**
+   * 只遍历一次各阶, 元素存在时合并, 不存在时在第一个空slot上初始化.
+   * 用于计数/聚合, 代替 find + insert_new 的两次查找.
+   * @param init_fn void init_fn(T &v); v为已经setKey(key)的空元素
+   * @param merge_fn void merge_fn(T &v); 原地合并已存在元素, 不能修改key
+   * @return 同insert_new, 如果bool是true则表示插入，false表示合并
+   * 无法插入时返回(end(), false)
+   */
+  template <typename InitFn, typename MergeFn>
+  std::pair<iterator, bool> upsert(const Key key, InitFn init_fn,
+                                   MergeFn merge_fn) {
+    SEGMENT_MAP_LATENCY(OP_UPSERT);
     if (key == NIL_KEY)  // unlikely
       return {end(), false};
 
-    size_t index = npos;
-    for (size_t i = 0; i < STAGE; ++i) {
-      index = (key % _buckets[i].size) + _buckets[i].offset;
-      // ScopeWLock lock(&_buckets[i]._rwlock);
-      Key slotKey = _bucket_slots[index].getKey();
-      if (slotKey != NIL_KEY) {
-        if (slotKey == key)  // find same element
-          return {iterator(this, index), false};
+    std::pair<size_t, bool> r = _probe(key);
+    if (r.first == (size_t)npos)  // no empty space insert
+      return {end(), false};
 
-#ifdef TEST_SegmentMap
-        ++_find_count;
-#endif
-        continue;  // not same
+    T &slot = _bucket_slots[r.first];
+    _tracker().mark(r.first);
+    if (r.second) {  // find same element, merge
+      merge_fn(slot);
+      return {iterator(this, r.first), false};
+    }
+
+    _construct(r.first);
+    slot.setKey(key);
+    try {
+      init_fn(slot);
+    } catch (...) {
+      // 初始化失败时恢复为空slot, 与_used_size保持一致
+      slot.setKey((Key)NIL_KEY);
+      throw;
+    }
+    ++_used_size;
+    return {iterator(this, r.first), true};
+  }
+
+  /**
+   * upsert的计数版本, 不存在时field初始化为delta, 存在时加上delta.
+   * @note 与其他修改操作一样只允许一个写线程
+   * @param field 计数成员
+   * @return 同upsert
+   */
+  template <typename M>
+  std::pair<iterator, bool> upsert_add(const Key key, M T::*field,
+                                       const M delta) {
+    return upsert(key, [field, delta](T &v) { v.*field = delta; },
+                  [field, delta](T &v) { v.*field += delta; });
+  }
+
+  /**
+   * upsert_add的并发版本, 多个线程可以同时调用.
+   * 空slot通过对key的CAS(NIL_KEY -> key)占用, CAS失败且slot已经是同一个key时按已存在处理.
+   * 初始化和合并都对field做原子加, 占用前field的旧值在占用后减去,
+   * 所以其他线程在初始化完成前的合并不会丢失.
+   * @note 并发期间只能与其他upsert_add_atomic同时调用, 不能与erase等修改操作并发;
+   *       新元素只设置key和field, T的其他成员保持空slot的值
+   * @param key_field 存储key的成员, 需要是整数类型
+   * @param field 计数成员
+   * @return 同upsert
+   */
+  template <typename M>
+  std::pair<iterator, bool> upsert_add_atomic(const Key key, Key T::*key_field,
+                                              M T::*field, const M delta) {
+    static_assert(std::is_integral<Key>::value,
+                  "upsert_add_atomic need integral key");
+    SEGMENT_MAP_LATENCY(OP_UPSERT);
+    if (key == NIL_KEY)  // unlikely
+      return {end(), false};
+
+    const hash_type h = Hash::hash(key, 0);
+    for (size_t i = 0; i < _stage; ++i) {
+      size_t index = _index(key, h, i);
+      T &slot = _bucket_slots[index];
+      Key slotKey = __atomic_load_n(&(slot.*key_field), __ATOMIC_ACQUIRE);
+      if (slotKey == NIL_KEY) {
+        // 只有占用成功的线程会写空slot的field, CAS之前读到的值是稳定的
+        const M old = __atomic_load_n(&(slot.*field), __ATOMIC_RELAXED);
+        Key expected = NIL_KEY;
+        if (__atomic_compare_exchange_n(&(slot.*key_field), &expected, key,
+                                        false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE)) {
+          __atomic_fetch_add(&(slot.*field), delta, __ATOMIC_RELAXED);
+          __atomic_fetch_sub(&(slot.*field), old, __ATOMIC_RELAXED);
+          __atomic_fetch_add(&_used_size, 1, __ATOMIC_RELAXED);
+          _tracker().mark(index);
+          return {iterator(this, index), true};
+        }
+        slotKey = expected;
       }
 
-      // find empty slot insert
-      _bucket_slots[index] = v;
-      ++_used_size;
+      if (slotKey == key) {  // find same element, or lost the race to it
+        __atomic_fetch_add(&(slot.*field), delta, __ATOMIC_RELAXED);
+        _tracker().mark(index);
+        return {iterator(this, index), false};
+      }
+    }
+
+    return {end(), false};
+  }
 
-      return {iterator(this, index), false};
+  /**
+   * 批量upsert. 提前预取后续元素第一阶的slot, 隐藏cache miss.
+   * 预取需要提前读取后面的元素, 所以要求ForwardIt(可以多次遍历)
+   * @param key_fn Key key_fn(const Item &item);
+   * @param init_fn void init_fn(T &v, const Item &item);
+   * @param merge_fn void merge_fn(T &v, const Item &item);
+   * @return 无法插入的item数量
+   */
+  template <typename ForwardIt, typename KeyFn, typename InitFn,
+            typename MergeFn>
+  size_t upsert_batch(ForwardIt first, ForwardIt last, KeyFn key_fn,
+                      InitFn init_fn, MergeFn merge_fn) {
+    enum { PREFETCH_DIST = 8 };
+
+    ForwardIt ahead = first;
+    for (size_t i = 0; i < PREFETCH_DIST && ahead != last; ++i, ++ahead) {
+      _prefetch(key_fn(*ahead));
     }
 
-    // no empty space insert, replace one
-    index = npos;
-    size_t leftIndex =
-        (key % _buckets[STAGE - 1].size) + _buckets[STAGE - 1].offset;
-    for (size_t i = 0; i < STAGE - 1; ++i) {
-      index = (key % _buckets[i].size) + _buckets[i].offset;
-      if (not fn(_bucket_slots[leftIndex], _bucket_slots[index])) {
-        leftIndex = index;
+    size_t failed = 0;
+    for (; first != last; ++first) {
+      if (ahead != last) {
+        _prefetch(key_fn(*ahead));
+        ++ahead;
       }
+
+      const auto &item = *first;
+      std::pair<iterator, bool> r =
+          upsert(key_fn(item), [&item, &init_fn](T &v) { init_fn(v, item); },
+                 [&item, &merge_fn](T &v) { merge_fn(v, item); });
+      if (r.first == end()) ++failed;
     }
 
-    if (replaced) *replaced = _bucket_slots[index];
+    return failed;
+  }
 
-    _bucket_slots[leftIndex] = v;
+  /**
+   * inser a element,
+   * 如果无法插入则会通过选择函数找到一个替换的元素进行替换,一定会插入成功.
+   * 一般用于实现淘汰插入.
+   * 元素的key不能为NIL_KEY,
+   * @param fn 替代选择函数 bool fn(const T&l, const T&r);
+   *  当无法插入时，会把所有与插入对象位置冲突的元素进行调用，在这些元素中选择一个最适合替换的进行淘汰，
+   *  接受两个与插入元素冲突的元素,返回true表示第一次对象被淘汰，false表示第二个对象被淘汰.
+   * @note 插入元素不会与冲突元素进行比较，这样保证插入元素肯定会被插入
+   * @param [out] replaced 不为NULL时，被替换的对象会被move到replaced中;
+   * @return 返回元素在内存中的索引，和是否进行了替换
+   */
+  template <typename Fn>
+  std::pair<iterator, bool> insert_or_replace(const T &v, Fn fn,
+                                              T *replaced = NULL /* out */) {
+    return _insert_or_replace(v, fn, replaced);
+  }
 
-    return {iterator(this, leftIndex), true};
+  template <typename Fn>
+  std::pair<iterator, bool> insert_or_replace(T &&v, Fn fn,
+                                              T *replaced = NULL /* out */) {
+    return _insert_or_replace(std::move(v), fn, replaced);
   }
 
   //兼容STL, same insert_new/1
   std::pair<iterator, bool> insert(const T &v) { return insert_new(v); }
 
+  std::pair<iterator, bool> insert(T &&v) { return insert_new(std::move(v)); }
+
   std::pair<iterator, bool> insert(const T &v, iterator &it) {
     _bucket_slots[it.index()] = v;
+    _tracker().mark(it.index());
+    return {it, true};
+  }
+
+  std::pair<iterator, bool> insert(T &&v, iterator &it) {
+    _bucket_slots[it.index()] = std::move(v);
+    _tracker().mark(it.index());
     return {it, true};
   }
 
@@ -307,39 +522,55 @@ class SegmentMap
    * 当返回npos时，表示无法插入
    */
   std::pair<iterator, bool> insert_or_update(const T &v) {
-    const Key &key = v.getKey();
+    return _insert_or_update(v);
+  }
 
-    if (key == NIL_KEY)  // unlikely
-      return {end(), false};
+  std::pair<iterator, bool> insert_or_update(T &&v) {
+    return _insert_or_update(std::move(v));
+  }
 
-    size_t index = npos;
-    for (size_t i = 0; i < STAGE; ++i) {
-      // check bitmap[rom + offset] is set
-      index = (key % _buckets[i].size) + _buckets[i].offset;
-      // ScopeWLock lock(&_buckets[i]._rwlock);
-      Key slotKey = _bucket_slots[index].getKey();
-      if (slotKey != NIL_KEY) {
-        if (slotKey == key) {  // find same element,update
-          // write Lock
-          _bucket_slots[index] = v;
-          return {iterator(this, index), false};
-        }
+  /**
+   * 开启变更跟踪, 之后所有修改操作都会标记所在的chunk. 需要Tracker为segment_dirty::DirtyBitmap.
+   * 通过iterator/operator[]直接修改元素时需要调用mark_dirty.
+   * @param chunk_slots 跟踪粒度, 向上取整为2的幂. 开启时所有chunk都为脏
+   */
+  void enable_dirty_tracking(size_t chunk_slots = 64) {
+    _tracker().enable(_max_size, chunk_slots);
+  }
 
-// not same find next stage
-#ifdef TEST_SegmentMap
-        ++_find_count;
-#endif
-        continue;
-      }
+  void disable_dirty_tracking() { _tracker().disable(); }
 
-      // find empty slot insert
-      _bucket_slots[index] = v;
-      ++_used_size;
-      return {iterator(this, index), true};
-    }
+  bool dirty_tracking() const { return _tracker().enabled(); }
 
-    // no empty space insert
-    return {end(), false};
+  void mark_dirty(const iterator &it) { _tracker().mark(it.index()); }
+
+  /**
+   * 导出上次导出后修改过的slot, 并清除脏标记.
+   * 每个chunk的所有slot都会导出, 空slot表示元素已经被删除.
+   * @note 与其他修改操作一样, 不能与写操作同时进行
+   * @param fn void fn(size_t first, const T *slots, size_t count);
+   * @return 导出的chunk数量
+   */
+  template <typename Fn>
+  size_t export_dirty(Fn fn) {
+    return _tracker().drain([this, &fn](size_t first, size_t count) {
+      fn(first, (const T *)_bucket_slots + first, count);
+    });
+  }
+
+  /**
+   * 备机应用export_dirty导出的slot. 两边的slot_count和segment_count必须相同, 备机不需要开启跟踪
+   */
+  void apply_slots(size_t first, const T *slots, size_t count) {
+    assert(first + count <= _max_size);
+    for (size_t i = 0; i < count; ++i) {
+      T &slot = _bucket_slots[first + i];
+      const bool was_used = slot.getKey() != NIL_KEY;
+      const bool used = slots[i].getKey() != NIL_KEY;
+      slot = slots[i];
+      _tracker().mark(first + i);
+      _used_size += (size_t)used - (size_t)was_used;
+    }
   }
 
   /**
@@ -347,59 +578,75 @@ class SegmentMap
    * @return 返回是否删除成功。（是否有该元素)
    */
   bool erase(const Key key) {
-    size_t index = find(key).index();
-    if (index == npos) return false;
+    SEGMENT_MAP_LATENCY(OP_ERASE);
+    size_t index = _find(key);
+    if (index == (size_t)npos) return false;
 
     // ScopeWLock lock(&_buckets[STAGE-1]._rwlock);
     _bucket_slots[index].setKey(NIL_KEY);
+    _tracker().mark(index);
     --_used_size;
 
     return true;
   }
 
   void erase(const iterator &it) {
+    SEGMENT_MAP_LATENCY(OP_ERASE);
     size_t index = it.index();
 
     // ScopeWLock lock(&_buckets[STAGE-1]._rwlock);
     _bucket_slots[index].setKey(NIL_KEY);
+    _tracker().mark(index);
     --_used_size;
   }
 
+  /**
+   * 重新初始化(清空)容器
+   * @return 成功返回0, 阶数不合法或slot数量不足时返回-1
+   */
   int init() {
-    //计算stage大小
-    // xxxxxxxxxxxxxxxxxx
-    // xxxxxxxxxxxxxxx
-    // xxxxxxxxxxx
-    // xxxxx
-    //每一阶的大小为素数,数量依次递减,
-    //目前使用素数序列，
-    // TODO
-    //数量的选择采用等比数列 减少的系数为1.3
-
-    size_t used = 0;
-    size_t size = MAP_SIZE / STAGE;
-    for (size_t i = 1; i < STAGE; ++i) {
-      size = find_perv_prime(size);
-      _buckets[i].size = size;
-      used += size;
-    }
-    size = MAP_SIZE - used;
-    size = find_perv_prime(size);
-    _buckets[0].size = size;
-
-    // clc offset
-    used = 0;
-    for (size_t i = 0; i < STAGE; ++i) {
-      _buckets[i].offset = used;
-      used += _buckets[i].size;
-    }
+    size_t used = _init_buckets();
+    if (used == 0) return -1;
 
-    _max_size = used;
-    _isInit = true;
-    _used_size = 0;
+    _release_slots();
+    _bucket_slots = _storage().template allocate<T>(used);
+
+    _init_size(used);
     return 0;
   }
 
+  /**
+   * 冷热分层存储, 重新初始化(清空)容器. 需要Storage为segment_tier::TieredStorage.
+   * 前hot_stages阶在内存中, 后面的阶映射到文件path, 由page cache换入换出.
+   * 大部分元素在前几阶, 大部分查找不会访问文件.
+   * @param path 冷数据文件, 会被截断重建
+   * @param hot_stages 使用内存的阶数, >= stage()时全部在内存中
+   * @return 成功返回0. 失败返回-1, 此时容器使用普通内存存储
+   */
+  int init_tiered(const char *path, size_t hot_stages) {
+    size_t used = _init_buckets();
+    if (used == 0) return -1;
+    size_t hot = hot_stages < _stage ? _buckets[hot_stages].offset : used;
+
+    _release_slots();
+    _bucket_slots = _storage().template allocate_tiered<T>(path, used, hot);
+    const bool ok = _bucket_slots != NULL;
+    if (!ok) _bucket_slots = _storage().template allocate<T>(used);
+
+    _init_size(used);
+    return ok ? 0 : -1;
+  }
+
+  bool tiered() const { return _storage().mapped(); }
+
+  /**
+   * 在内存中的slot数量, 下标小于该值的slot不会访问文件
+   */
+  size_t hot_size() const {
+    return tiered() ? std::min(_storage().hot_bytes() / sizeof(T), _max_size)
+                    : _max_size;
+  }
+
 #ifdef TEST_SegmentMap
  public:
   static void test();
@@ -408,6 +655,178 @@ class SegmentMap
  private:
 #endif
 
+  // @return slot总数, 失败返回0
+  size_t _init_buckets() {
+    if (_stage == 0 || _stage > MAX_SEGMENT_CNT) return 0;
+
+    return init_segment_buckets(_map_size, _stage, _buckets);
+  }
+
+  void _init_size(size_t used) {
+    _max_size = used;
+    _isInit = true;
+    _used_size = 0;
+    _tracker().resize(_max_size);
+  }
+
+  void _release_slots() {
+    if (_bucket_slots) _storage().release(_bucket_slots);
+    _bucket_slots = NULL;
+  }
+
+  Tracker &_tracker() { return *this; }
+  const Tracker &_tracker() const { return *this; }
+  Storage &_storage() { return *this; }
+  const Storage &_storage() const { return *this; }
+
+  /**
+   * 不记录延迟的find, 供count/modify/erase使用, 每个操作只记录一次
+   * @return 元素下标, 不存在时返回npos
+   */
+  size_t _find(const Key key) const {
+    if (key == NIL_KEY)  // unlikely
+      return npos;
+
+    const hash_type h = Hash::hash(key, 0);
+    for (size_t i = 0; i < _stage; ++i) {
+      size_t index = _index(key, h, i);
+      if (_bucket_slots[index].getKey() == key) return index;
+    }
+
+    return npos;
+  }
+
+  /**
+   * 依次查找每一阶, 返回第一个key相同或者为空的slot
+   * @return (下标, 是否为已存在元素), 所有阶都冲突时返回(npos, false)
+   */
+  std::pair<size_t, bool> _probe(const Key key) {
+    const hash_type h = Hash::hash(key, 0);
+    for (size_t i = 0; i < _stage; ++i) {
+      size_t index = _index(key, h, i);
+      // ScopeWLock lock(&_buckets[i]._rwlock);
+      Key slotKey = _bucket_slots[index].getKey();
+      if (slotKey == NIL_KEY) return {index, false};
+
+      if (slotKey == key)  // find same element
+        return {index, true};
+
+#ifdef TEST_SegmentMap
+      ++_find_count;
+#endif
+    }
+
+    return {npos, false};
+  }
+
+  // 预取key在第一阶的slot
+  void _prefetch(const Key key) const {
+    __builtin_prefetch(_bucket_slots + slot_index(key, 0));
+  }
+
+  // 第stage阶的下标, h为Hash::hash(key, 0). PER_STAGE为0时不会重新计算hash
+  size_t _index(const Key key, const hash_type h, size_t stage) const {
+    return ((Hash::PER_STAGE ? Hash::hash(key, stage) : h) %
+            _buckets[stage].size) +
+           _buckets[stage].offset;
+  }
+
+  // 在index上重新构造元素, 构造失败时slot恢复为空元素
+  template <typename... Args>
+  void _construct(size_t index, Args &&... args) {
+    T *p = _bucket_slots + index;
+    p->~T();
+    try {
+      ::new (static_cast<void *>(p)) T(std::forward<Args>(args)...);
+    } catch (...) {
+      ::new (static_cast<void *>(p)) T();
+      throw;
+    }
+  }
+
+  template <typename V>
+  std::pair<iterator, bool> _insert_new(V &&v) {
+    SEGMENT_MAP_LATENCY(OP_INSERT_NEW);
+    const Key key = v.getKey();
+
+    if (key == NIL_KEY)  // unlikely
+      return {end(), false};
+
+    std::pair<size_t, bool> r = _probe(key);
+    if (r.first == (size_t)npos)  // no empty space insert
+      return {end(), false};
+
+    if (r.second)  // find same element
+      return {iterator(this, r.first), false};
+
+    // find empty slot insert
+    _bucket_slots[r.first] = std::forward<V>(v);
+    _tracker().mark(r.first);
+    ++_used_size;
+
+    return {iterator(this, r.first), true};
+  }
+
+  template <typename V>
+  std::pair<iterator, bool> _insert_or_update(V &&v) {
+    SEGMENT_MAP_LATENCY(OP_INSERT_OR_UPDATE);
+    const Key key = v.getKey();
+
+    if (key == NIL_KEY)  // unlikely
+      return {end(), false};
+
+    std::pair<size_t, bool> r = _probe(key);
+    if (r.first == (size_t)npos)  // no empty space insert
+      return {end(), false};
+
+    // write Lock
+    _bucket_slots[r.first] = std::forward<V>(v);
+    _tracker().mark(r.first);
+    if (r.second)  // find same element,update
+      return {iterator(this, r.first), false};
+
+    // find empty slot insert
+    ++_used_size;
+    return {iterator(this, r.first), true};
+  }
+
+  template <typename V, typename Fn>
+  std::pair<iterator, bool> _insert_or_replace(V &&v, Fn &fn, T *replaced) {
+    SEGMENT_MAP_LATENCY(OP_INSERT_OR_REPLACE);
+    const Key key = v.getKey();
+
+    if (key == NIL_KEY)  // unlikely
+      return {end(), false};
+
+    std::pair<size_t, bool> r = _probe(key);
+    if (r.second)  // find same element
+      return {iterator(this, r.first), false};
+
+    if (r.first != (size_t)npos) {
+      // find empty slot insert
+      _bucket_slots[r.first] = std::forward<V>(v);
+      _tracker().mark(r.first);
+      ++_used_size;
+      return {iterator(this, r.first), false};
+    }
+
+    // no empty space insert, replace one
+    size_t leftIndex = slot_index(key, _stage - 1);
+    for (size_t i = 0; i < _stage - 1; ++i) {
+      size_t index = slot_index(key, i);
+      if (not fn(_bucket_slots[leftIndex], _bucket_slots[index])) {
+        leftIndex = index;
+      }
+    }
+
+    if (replaced) *replaced = std::move(_bucket_slots[leftIndex]);
+
+    _bucket_slots[leftIndex] = std::forward<V>(v);
+    _tracker().mark(leftIndex);
+
+    return {iterator(this, leftIndex), true};
+  }
+
   // struct ScopeWLock
   //{
   //    ScopeWLock(pthread_rwlock_t *l)
@@ -421,23 +840,17 @@ class SegmentMap
   //    pthread_rwlock_t *_l;
   //};
 
-  struct {
-    //根据MAP_SIZE 自动选择是uint16_t 还是uint32_t
-    // using uint = typename std::conditional<MAP_SIZE <
-    // std::numeric_limits<uint16_t>::max(),
-    //      uint16_t,
-    //      uint32_t>::type;
+  // pthread_rwlock_t _rwlock; //每一个bucket一个锁
+  SegmentBucket _buckets[MAX_SEGMENT_CNT];  //存储每阶段大小,和偏移值
 
-    uint32_t size;
-    uint32_t offset;
-    // pthread_rwlock_t _rwlock; //每一个bucket一个锁
-  } _buckets[STAGE];  //存储每阶段大小,和偏移值
+  size_t _stage;     //阶数量
+  size_t _map_size;  //构造时指定的slot数量
 
   bool _isInit;
   size_t _max_size;   //总元素数量
   size_t _used_size;  //当前的元素个数
 
-  T _bucket_slots[MAP_SIZE];
+  T *_bucket_slots;
 };
 
 #endif  // HASHTABLE_SEGMENT_MAP_HPP
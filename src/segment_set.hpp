@@ -4,7 +4,24 @@
 #ifndef HASHTABLE_SEGMENT_SET_HPP
 #define HASHTABLE_SEGMENT_SET_HPP
 
-#include <hashtable_common.hpp>
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "hashtable_common.hpp"
+#include "segment_simd.hpp"
+
+/**
+ * 默认的取key方法, 调用T::getKey()
+ */
+template <typename Key, typename T>
+struct segment_set_get_key {
+    Key operator()(const T &t) const { return t.getKey(); }
+};
 
 /**
  * 容器的内存结构是连续的.并且元素中包含key
@@ -15,21 +32,29 @@
  * 当公共溢出池超过指定阈值时会重新hash,可以选择固定大小table,则存在无法插入情况
  *
  * @param T 成员类型,需要为T类型实现segment_set_get_key<Key,T>(T t) -> Key 方法
+ *          并实现 void setKey(Key key) 用于删除元素
  *
  * @param NIL_KEY 被认为是空元素的Key值。有效元素的key不能为NIL_KEY
  * @param GetKey 函数对象，返回值的key
+ * @param Hash 计算各阶下标前对key的变换, 见segment_hash. 默认直接使用key
+ * @note T与Key相同时使用只存储key的特化版本, 见CompactSegmentSet
  */
 
 
 template <typename Key,
           Key NIL_KEY,
           typename T,
-          typename GetKeyFn = segment_set_get_key<Key,T>
+          typename GetKeyFn = segment_set_get_key<Key,T>,
+          typename Hash = segment_hash::identity
          >
 class SegmentSet
 {
+    typedef SegmentSet container_type;
+    typedef decltype(Hash::hash(Key(), 0)) hash_type;
+
 public:
     enum { npos = -1 };
+    enum { MAX_SEGMENT_CNT = 64 };
 
 public:
     /**
@@ -37,8 +62,15 @@ public:
     * @param slot_count 初始化表元素数量
     * @param segment_count 分为多少阶
     *        阶数量，一般在20~50，数量越大利用率越高，但是查找速度越慢.反之依然.
+    * @throw std::invalid_argument slot_count不足以分出segment_count个素数大小的阶
     */
-    SegmentSet(size_t slot_count, int segment_count) { init(); }
+    SegmentSet(size_t slot_count, int segment_count)
+        : _stage(segment_count), _map_size(slot_count), _bucket_slots(NULL) {
+        if (init() != 0)
+            throw std::invalid_argument("SegmentSet: too few slots for segment_count");
+    }
+
+    ~SegmentSet() { delete[] _bucket_slots; }
 
 private:
     SegmentSet(const SegmentSet &);
@@ -51,7 +83,7 @@ private:
 
         _Iter &operator++(void) {
             for (size_t i = _index + 1; i < _continer->_max_size; ++i) {
-                if (_continer->_bucket_slots[i].getKey() != NIL_KEY) {
+                if (_continer->key_of(i) != NIL_KEY) {
                     _index = i;
                     return *this;
                 }
@@ -63,23 +95,11 @@ private:
 
         _Iter operator++(int) {
             size_t old_index = _index;
-            for (size_t i = _index + 1; i < _continer->_max_size; ++i) {
-                if (_continer->_bucket_slots[i].getKey() != NIL_KEY) {
-                    _index = i;
-                    return _Iter(this, old_index);
-                }
-            }
-
-            _index = npos;
-            return _Iter(this, old_index);
+            ++*this;
+            return _Iter(_continer, old_index);
         }
 
-        void erase() {
-            if (_continer->bitmap.test(_index)) {
-                _continer->bitmap.reset(_index);
-                --_continer->_used_size;
-            }
-        }
+        void erase() { _continer->erase(*this); }
 
         T &operator*() { return _continer->_bucket_slots[_index]; }
 
@@ -109,7 +129,7 @@ public:
 
         // find first
         for (size_t i = 0; i < _max_size; ++i) {
-            if (_bucket_slots[i].getKey() != NIL_KEY) return _Iter(this, i);
+            if (key_of(i) != NIL_KEY) return _Iter(this, i);
         }
 
         return end();  // can not run here
@@ -117,9 +137,11 @@ public:
 
     iterator end() { return _Iter(this, npos); }
 
-    iterator end() const { return _Iter(this, npos); }
+    iterator end() const {
+        return _Iter(const_cast<container_type *>(this), npos);
+    }
 
-    size_t stage() const { return STAGE; }
+    size_t stage() const { return _stage; }
 
     bool empty() const { return _used_size == 0; }
 
@@ -141,7 +163,6 @@ public:
      * clear the contents. same as STL map.clear()
      */
     void clear() {
-        // ScopeWLock lock(&_buckets[STAGE-1]._rwlock);
         for (_Iter it = begin(); it != end(); ++it) {
             it->setKey((Key)NIL_KEY);
         }
@@ -158,10 +179,10 @@ public:
         if (key == NIL_KEY)  // unlikely
             return end();
 
-        size_t index = npos;
-        for (size_t i = 0; i < STAGE; ++i) {
-            index = (key % _buckets[i].size) + _buckets[i].offset;
-            if (_bucket_slots[index].getKey() == key) {
+        const hash_type h = Hash::hash(key, 0);
+        for (size_t i = 0; i < _stage; ++i) {
+            size_t index = _index(key, h, i);
+            if (key_of(index) == key) {
                 return iterator(this, index);
             }
         }
@@ -189,35 +210,23 @@ public:
      *
      */
     std::pair<iterator, bool> insert_new(const T &v) {
-        const Key key = v.getKey();
+        const Key key = GetKeyFn()(v);
 
         if (key == NIL_KEY)  // unlikely
             return {end(), false};
 
-        size_t index = npos;
-        for (size_t i = 0; i < STAGE; ++i) {
-            index = (key % _buckets[i].size) + _buckets[i].offset;
-            // ScopeWLock lock(&_buckets[i]._rwlock);
-            Key slotKey = _bucket_slots[index].getKey();
-            if (slotKey != NIL_KEY) {
-                if (slotKey == key)  // find same element
-                    return {iterator(this, index), false};
-
-#ifdef TEST_SegmentSet
-                ++_find_count;
-#endif
-                continue;  // not same
-            }
+        std::pair<size_t, bool> r = _probe(key);
+        if (r.first == (size_t)npos)  // no empty space insert
+            return {end(), false};
 
-            // find empty slot insert
-            _bucket_slots[index] = v;
-            ++_used_size;
+        if (r.second)  // find same element
+            return {iterator(this, r.first), false};
 
-            return {iterator(this, index), true};
-        }
+        // find empty slot insert
+        _bucket_slots[r.first] = v;
+        ++_used_size;
 
-        // no empty space insert
-        return {end(), false};
+        return {iterator(this, r.first), true};
     }
 
     /**
@@ -232,49 +241,36 @@ public:
      * @param [out] replaced 不为NULL时，返回被替换的对象;
      * @return 返回元素在内存中的索引，和是否进行了替换
      */
-    // TODO test
     template <typename Fn>
     std::pair<iterator, bool> insert_or_replace(const T &v, Fn fn,
                                                 T *replaced = NULL /* out */) {
-        const Key key = v.getKey();
+        const Key key = GetKeyFn()(v);
 
         if (key == NIL_KEY)  // unlikely
             return {end(), false};
 
-        size_t index = npos;
-        for (size_t i = 0; i < STAGE; ++i) {
-            index = (key % _buckets[i].size) + _buckets[i].offset;
-            // ScopeWLock lock(&_buckets[i]._rwlock);
-            Key slotKey = _bucket_slots[index].getKey();
-            if (slotKey != NIL_KEY) {
-                if (slotKey == key)  // find same element
-                    return {iterator(this, index), false};
-
-#ifdef TEST_SegmentSet
-                ++_find_count;
-#endif
-                continue;  // not same
-            }
+        std::pair<size_t, bool> r = _probe(key);
+        if (r.second)  // find same element
+            return {iterator(this, r.first), false};
 
+        if (r.first != (size_t)npos) {
             // find empty slot insert
-            _bucket_slots[index] = v;
+            _bucket_slots[r.first] = v;
             ++_used_size;
-
-            return {iterator(this, index), false};
+            return {iterator(this, r.first), false};
         }
 
         // no empty space insert, replace one
-        index = npos;
-        size_t leftIndex =
-                (key % _buckets[STAGE - 1].size) + _buckets[STAGE - 1].offset;
-        for (size_t i = 0; i < STAGE - 1; ++i) {
-            index = (key % _buckets[i].size) + _buckets[i].offset;
+        const hash_type h = Hash::hash(key, 0);
+        size_t leftIndex = _index(key, h, _stage - 1);
+        for (size_t i = 0; i < _stage - 1; ++i) {
+            size_t index = _index(key, h, i);
             if (not fn(_bucket_slots[leftIndex], _bucket_slots[index])) {
                 leftIndex = index;
             }
         }
 
-        if (replaced) *replaced = _bucket_slots[index];
+        if (replaced) *replaced = _bucket_slots[leftIndex];
 
         _bucket_slots[leftIndex] = v;
 
@@ -295,39 +291,22 @@ public:
      * 当返回npos时，表示无法插入
      */
     std::pair<iterator, bool> insert_or_update(const T &v) {
-        const Key &key = v.getKey();
+        const Key key = GetKeyFn()(v);
 
         if (key == NIL_KEY)  // unlikely
             return {end(), false};
 
-        size_t index = npos;
-        for (size_t i = 0; i < STAGE; ++i) {
-            // check bitmap[rom + offset] is set
-            index = (key % _buckets[i].size) + _buckets[i].offset;
-            // ScopeWLock lock(&_buckets[i]._rwlock);
-            Key slotKey = _bucket_slots[index].getKey();
-            if (slotKey != NIL_KEY) {
-                if (slotKey == key) {  // find same element,update
-                    // write Lock
-                    _bucket_slots[index] = v;
-                    return {iterator(this, index), false};
-                }
-
-// not same find next stage
-#ifdef TEST_SegmentSet
-                ++_find_count;
-#endif
-                continue;
-            }
+        std::pair<size_t, bool> r = _probe(key);
+        if (r.first == (size_t)npos)  // no empty space insert
+            return {end(), false};
 
-            // find empty slot insert
-            _bucket_slots[index] = v;
-            ++_used_size;
-            return {iterator(this, index), true};
-        }
+        _bucket_slots[r.first] = v;
+        if (r.second)  // find same element,update
+            return {iterator(this, r.first), false};
 
-        // no empty space insert
-        return {end(), false};
+        // find empty slot insert
+        ++_used_size;
+        return {iterator(this, r.first), true};
     }
 
     /**
@@ -338,7 +317,6 @@ public:
         size_t index = find(key).index();
         if (index == npos) return false;
 
-        // ScopeWLock lock(&_buckets[STAGE-1]._rwlock);
         _bucket_slots[index].setKey(NIL_KEY);
         --_used_size;
 
@@ -348,7 +326,6 @@ public:
     void erase(const iterator &it) {
         size_t index = it.index();
 
-        // ScopeWLock lock(&_buckets[STAGE-1]._rwlock);
         _bucket_slots[index].setKey(NIL_KEY);
         --_used_size;
     }
@@ -357,36 +334,15 @@ public:
     //TODO static
 
 
+    //@return 成功返回0, 阶数不合法或slot数量不足时返回-1
     int init() {
+        if (_stage == 0 || _stage > MAX_SEGMENT_CNT) return -1;
 
-        SegmentSet(size_t slot_count, int segment_count) { init(); }
-        //计算stage大小
-        // xxxxxxxxxxxxxxxxxx
-        // xxxxxxxxxxxxxxx
-        // xxxxxxxxxxx
-        // xxxxx
-        //每一阶的大小为素数,数量依次递减,
-        //目前使用素数序列，
-        // TODO
-        //数量的选择采用等比数列 减少的系数为1.3
-
-        size_t used = 0;
-        size_t size = MAP_SIZE / STAGE;
-        for (size_t i = 1; i < STAGE; ++i) {
-            size = find_perv_prime(size);
-            _buckets[i].size = size;
-            used += size;
-        }
-        size = MAP_SIZE - used;
-        size = find_perv_prime(size);
-        _buckets[0].size = size;
-
-        // clc offset
-        used = 0;
-        for (size_t i = 0; i < STAGE; ++i) {
-            _buckets[i].offset = used;
-            used += _buckets[i].size;
-        }
+        size_t used = init_segment_buckets(_map_size, _stage, _buckets);
+        if (used == 0) return -1;
+
+        delete[] _bucket_slots;
+        _bucket_slots = new T[used];
 
         _max_size = used;
         _isInit = true;
@@ -395,31 +351,45 @@ public:
     }
 
 #ifdef TEST_SegmentSet
-    public:
-  static void test();
-  size_t _find_count = 0;
+public:
+    static void test();
+    size_t _find_count = 0;
 #else
 private:
 #endif
 
-enum {
-    MAX_SEGMENT_CNT = 40
-};
+    Key key_of(size_t index) const { return GetKeyFn()(_bucket_slots[index]); }
 
-    struct Header {
-        size_t mem_size_; //内存大小
-        size_t ele_size_; //当前元素大小
-        size_t captial_size_;
-        size_t segment_cnt;
-        struct {
-            uint32_t offset;
-            uint32_t size;
-        } segments_[MAX_SEGMENT_CNT];
-        T  data_[0];
-    };
+    /**
+     * 依次查找每一阶, 返回第一个key相同或者为空的slot
+     * @return (下标, 是否为已存在元素), 所有阶都冲突时返回(npos, false)
+     */
+    std::pair<size_t, bool> _probe(const Key key) {
+        const hash_type h = Hash::hash(key, 0);
+        for (size_t i = 0; i < _stage; ++i) {
+            size_t index = _index(key, h, i);
+            Key slotKey = key_of(index);
+            if (slotKey == NIL_KEY) return {index, false};
+
+            if (slotKey == key)  // find same element
+                return {index, true};
+
+#ifdef TEST_SegmentSet
+            ++_find_count;
+#endif
+        }
+
+        return {npos, false};
+    }
+
+    // 第stage阶的下标, h为Hash::hash(key, 0). PER_STAGE为0时不会重新计算hash
+    size_t _index(const Key key, const hash_type h, size_t stage) const {
+        return ((Hash::PER_STAGE ? Hash::hash(key, stage) : h) % _buckets[stage].size) +
+               _buckets[stage].offset;
+    }
 
     /*
-   *整个表线数据是连续的，方便导出或者是在共享内存上使用(暂时不支持)
+    *整个表线数据是连续的，方便导出或者是在共享内存上使用(暂时不支持)
     *内存布局
      *
      * head
@@ -429,25 +399,371 @@ enum {
      *
      */
 
-    struct {
-        //根据MAP_SIZE 自动选择是uint16_t 还是uint32_t
-        // using uint = typename std::conditional<MAP_SIZE <
-        // std::numeric_limits<uint16_t>::max(),
-        //      uint16_t,
-        //      uint32_t>::type;
+    SegmentBucket _buckets[MAX_SEGMENT_CNT];  //存储每阶段大小,和偏移值
+
+    size_t _stage;     //阶数量
+    size_t _map_size;  //构造时指定的slot数量
+
+    bool _isInit;
+    size_t _max_size;   //总元素数量
+    size_t _used_size;  //当前的元素个数
+
+    T *_bucket_slots;
+};
+
+
+/**
+ * 只存储key的多阶hash set, 用于整数id的去重, 黑名单等.
+ * key紧密存储在Slot数组中, 探测时没有T和getKey()的开销.
+ * NOT MT-safe
+ *
+ * @param Key 整数key类型
+ * @param NIL_KEY 被认为是空元素的Key值
+ * @param Slot 存储key使用的整数类型, key的范围允许时可以使用更窄的类型,
+ *        例如 CompactSegmentSet<uint64_t, 0, uint32_t> 内存减半,
+ *        Slot不超过32位时计算每阶下标使用乘法代替除法.
+ *        超出Slot范围的key无法插入, 查找时返回不存在
+ * @param Hash 同SegmentSet. Slot不超过32位时使用hash值的低32位计算下标
+ */
+template <typename Key, Key NIL_KEY, typename Slot = Key,
+          typename Hash = segment_hash::identity>
+class CompactSegmentSet
+{
+    static_assert(std::is_integral<Key>::value && std::is_integral<Slot>::value,
+                  "CompactSegmentSet need integral key");
+    static_assert((Key)(Slot)NIL_KEY == NIL_KEY, "NIL_KEY must fit in Slot");
+
+    typedef decltype(Hash::hash(Key(), 0)) hash_type;
+    typedef typename std::make_unsigned<hash_type>::type uhash_type;
+
+public:
+    enum { npos = -1 };
+    enum { MAX_SEGMENT_CNT = 64 };
+    // contains_batch使用SIMD的最大slot数组字节数, 更大的表使用预取
+    enum { SIMD_BATCH_MAX_BYTES = 64 * 1024 };
+
+public:
+    /**
+     * @param slot_count 初始化表元素数量
+     * @param segment_count 分为多少阶, 最大为MAX_SEGMENT_CNT
+     * @throw std::invalid_argument 同SegmentSet
+     */
+    CompactSegmentSet(size_t slot_count, int segment_count)
+        : _stage(segment_count), _map_size(slot_count), _slots(NULL) {
+        if (init() != 0)
+            throw std::invalid_argument("CompactSegmentSet: too few slots for segment_count");
+    }
+
+    ~CompactSegmentSet() { delete[] _slots; }
+
+private:
+    CompactSegmentSet(const CompactSegmentSet &);
+    void operator=(const CompactSegmentSet &);
+
+public:
+    class iterator {
+    public:
+        iterator(const CompactSegmentSet *c, size_t index) : _continer(c), _index(index) {}
+
+        iterator &operator++(void) {
+            _index = _continer->_next(_index + 1);
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator old = *this;
+            ++*this;
+            return old;
+        }
+
+        Key operator*() const { return (Key)_continer->_slots[_index]; }
+
+        bool operator==(const iterator &o) const {
+            return _index == o._index && _continer == o._continer;
+        }
+
+        bool operator!=(const iterator &o) const { return not operator==(o); }
+
+        size_t index() const { return _index; }
+
+    private:
+        const CompactSegmentSet *_continer;
+        size_t _index;
+    };
+
+    iterator begin() const { return iterator(this, empty() ? (size_t)npos : _next(0)); }
+
+    iterator end() const { return iterator(this, npos); }
+
+    size_t stage() const { return _stage; }
+
+    bool empty() const { return _used_size == 0; }
+
+    size_t size() const { return _used_size; }
+
+    size_t max_size() const { return _max_size; }
+
+    // slot数组占用的字节数
+    size_t memory_size() const { return _max_size * sizeof(Slot); }
+
+    /**
+     * 返回使用率
+     */
+    float used_rate() const { return (float)_used_size / _max_size; }
+
+    bool isInit() const { return _isInit; }
+
+    void clear() {
+        for (size_t i = 0; i < _max_size; ++i) _slots[i] = (Slot)NIL_KEY;
+        _used_size = 0;
+    }
+
+    /**
+     * 查找元素是否存在
+     * @return 返回元素迭代器，如果不存在返回end()
+     */
+    iterator find(const Key key) const {
+        if (!_valid(key))  // unlikely
+            return end();
+
+        const Slot s = (Slot)key;
+        const hash_type h = Hash::hash(key, 0);
+        for (size_t i = 0; i < _stage; ++i) {
+            size_t index = _index(key, h, i);
+            if (_slots[index] == s) return iterator(this, index);
+        }
+
+        return end();
+    }
+
+    bool contains(const Key key) const { return find(key) != end(); }
+
+    /**
+     * 同find, 使用SIMD一次计算多阶的下标并gather比较 (AVX-512每次8阶, AVX2每次4阶).
+     * 运行时根据CPU选择, 不支持, Slot不是32位或者Hash::PER_STAGE时使用find.
+     * 表在cache中或者key不存在时比find快, 大表上大部分key在前几阶命中时可能比find慢
+     */
+    iterator find_simd(const Key key) const {
+#ifdef SEGMENT_SIMD_X86
+        if (sizeof(Slot) == sizeof(uint32_t) && !Hash::PER_STAGE) {
+            if (!_valid(key))  // unlikely
+                return end();
+
+            int stage = -1;
+            const uint32_t *slots = reinterpret_cast<const uint32_t *>(_slots);
+            const uint32_t h = (uint32_t)(uhash_type)Hash::hash(key, 0);
+            switch (segment_simd::cpu_level()) {
+                case segment_simd::LEVEL_AVX512:
+                    stage = segment_simd::probe32_avx512(slots, _vec.magic, _vec.size,
+                                                         _vec.offset, _stage, (uint32_t)(Slot)key, h);
+                    break;
+                case segment_simd::LEVEL_AVX2:
+                    stage = segment_simd::probe32_avx2(slots, _vec.magic, _vec.size,
+                                                       _vec.offset, _stage, (uint32_t)(Slot)key, h);
+                    break;
+                default:
+                    return find(key);
+            }
+
+            return stage < 0 ? end() : iterator(this, _index(key, stage));
+        }
+#endif
+        return find(key);
+    }
+
+    bool contains_simd(const Key key) const { return find_simd(key) != end(); }
+
+    /**
+     * same STL set.count
+     */
+    size_t count(const Key key) const { return contains(key) ? 1 : 0; }
+
+    /**
+     * 批量查找, out[i] = contains(keys[i]).
+     * slot数组不超过SIMD_BATCH_MAX_BYTES时使用contains_batch_simd, 表在cache中时SIMD更快.
+     * 否则查找前先预取后面BATCH个key第一阶的slot, 多个key的cache miss可以重叠.
+     * 大表上预取比SIMD快: SIMD每组key中有一个不存在就要探测完所有阶, 而且gather比标量读取慢,
+     * 见bench BM_CompactContainsBatch
+     */
+    void contains_batch(const Key *keys, size_t n, bool *out) const {
+        if (memory_size() <= SIMD_BATCH_MAX_BYTES)
+            contains_batch_simd(keys, n, out);
+        else
+            _contains_batch_prefetch(keys, n, out);
+    }
+
+    /**
+     * 同contains_batch, 使用SIMD一次探测多个key的同一阶 (AVX-512每次8个key, AVX2每次4个key).
+     * 运行时根据CPU选择, 条件同find_simd, 不满足时使用预取的批量查找
+     */
+    void contains_batch_simd(const Key *keys, size_t n, bool *out) const {
+#ifdef SEGMENT_SIMD_X86
+        const segment_simd::Level level = segment_simd::cpu_level();
+        if (sizeof(Slot) == sizeof(uint32_t) && !Hash::PER_STAGE &&
+            level != segment_simd::LEVEL_SCALAR) {
+            const size_t lanes = level == segment_simd::LEVEL_AVX512 ? 8 : 4;
+            const uint32_t *slots = reinterpret_cast<const uint32_t *>(_slots);
+            uint32_t needles[segment_simd::MAX_LANES];
+            uint32_t hs[segment_simd::MAX_LANES];
+
+            for (size_t i = 0; i < n; i += lanes) {
+                unsigned active = 0;
+                for (size_t j = 0; j < lanes; ++j) {
+                    needles[j] = hs[j] = 0;
+                    if (i + j < n && _valid(keys[i + j])) {
+                        needles[j] = (uint32_t)(Slot)keys[i + j];
+                        hs[j] = (uint32_t)(uhash_type)Hash::hash(keys[i + j], 0);
+                        active |= 1u << j;
+                    }
+                }
+
+                const unsigned hit =
+                    level == segment_simd::LEVEL_AVX512
+                        ? segment_simd::batch32_avx512(slots, _vec.magic, _vec.size, _vec.offset,
+                                                       _stage, needles, hs, active)
+                        : segment_simd::batch32_avx2(slots, _vec.magic, _vec.size, _vec.offset,
+                                                     _stage, needles, hs, active);
+                for (size_t j = 0; j < lanes && i + j < n; ++j) out[i + j] = (hit >> j) & 1;
+            }
+            return;
+        }
+#endif
+        _contains_batch_prefetch(keys, n, out);
+    }
+
+    /**
+     * inser a element.
+     * 元素的key不能为NIL_KEY, 并且需要在Slot范围内
+     * @return 同SegmentSet::insert_new
+     */
+    std::pair<iterator, bool> insert_new(const Key key) {
+        if (!_valid(key))  // unlikely
+            return {end(), false};
+
+        const Slot s = (Slot)key;
+        const hash_type h = Hash::hash(key, 0);
+        for (size_t i = 0; i < _stage; ++i) {
+            size_t index = _index(key, h, i);
+            if (_slots[index] == s)  // find same element
+                return {iterator(this, index), false};
+
+            if (_slots[index] == (Slot)NIL_KEY) {
+                _slots[index] = s;
+                ++_used_size;
+                return {iterator(this, index), true};
+            }
+        }
+
+        // no empty space insert
+        return {end(), false};
+    }
+
+    //兼容STL, same insert_new/1
+    std::pair<iterator, bool> insert(const Key key) { return insert_new(key); }
+
+    /**
+     * 删除一个元素.
+     * @return 返回是否删除成功。（是否有该元素)
+     */
+    bool erase(const Key key) {
+        iterator it = find(key);
+        if (it == end()) return false;
+
+        erase(it);
+        return true;
+    }
+
+    void erase(const iterator &it) {
+        _slots[it.index()] = (Slot)NIL_KEY;
+        --_used_size;
+    }
 
-        uint32_t size;
-        uint32_t offset;
-    } _buckets[STAGE];  //存储每阶段大小,和偏移值
+    //@return 同SegmentSet::init
+    int init() {
+        if (_stage == 0 || _stage > MAX_SEGMENT_CNT) return -1;
 
-    bool is_init_;
+        size_t used = init_segment_buckets(_map_size, _stage, _buckets);
+        if (used == 0) return -1;
+        _vec.init(_buckets, _stage);
 
+        delete[] _slots;
+        _slots = new Slot[used];
 
-    SegmentSet(size_t slot_count, int segment_count) { init(); }
+        _max_size = used;
+        _isInit = true;
+        clear();
+        return 0;
+    }
 
-    T _bucket_slots[MAP_SIZE];
+private:
+    // key不是NIL_KEY, 并且可以无损的存储为Slot
+    static bool _valid(const Key key) {
+        return key != NIL_KEY && (Key)(Slot)key == key;
+    }
+
+    // 第stage阶的下标, h为Hash::hash(key, 0). PER_STAGE为0时不会重新计算hash.
+    // Slot不超过32位时, 有效的key也不超过32位, 只使用hash的低32位, 乘法代替取模
+    size_t _index(const Key key, const hash_type h, size_t stage) const {
+        const uhash_type v = (uhash_type)(Hash::PER_STAGE ? Hash::hash(key, stage) : h);
+        if (sizeof(Slot) <= sizeof(uint32_t))
+            return fastmod_u32((uint32_t)v, _vec.magic[stage], _buckets[stage].size) +
+                   _buckets[stage].offset;
+
+        return (size_t)(v % _buckets[stage].size) + _buckets[stage].offset;
+    }
+
+    size_t _index(const Key key, size_t stage) const {
+        return _index(key, Hash::hash(key, stage), stage);
+    }
+
+    void _prefetch(const Key key) const {
+        __builtin_prefetch(_slots + _index(key, 0));
+    }
+
+    void _contains_batch_prefetch(const Key *keys, size_t n, bool *out) const {
+        enum { BATCH = 8 };
+
+        for (size_t j = 0; j < BATCH && j < n; ++j) _prefetch(keys[j]);
+
+        for (size_t i = 0; i < n; i += BATCH) {
+            const size_t end = i + BATCH < n ? i + BATCH : n;
+            const size_t next_end = end + BATCH < n ? end + BATCH : n;
+            for (size_t j = end; j < next_end; ++j) _prefetch(keys[j]);
+
+            for (size_t j = i; j < end; ++j) out[j] = contains(keys[j]);
+        }
+    }
+
+    size_t _next(size_t from) const {
+        for (size_t i = from; i < _max_size; ++i) {
+            if (_slots[i] != (Slot)NIL_KEY) return i;
+        }
+        return npos;
+    }
+
+    SegmentBucket _buckets[MAX_SEGMENT_CNT];  //存储每阶段大小,和偏移值
+    segment_simd::StageVectors<MAX_SEGMENT_CNT> _vec;  //每阶取模使用的乘数, SIMD探测使用
+
+    size_t _stage;     //阶数量
+    size_t _map_size;  //构造时指定的slot数量
+
+    bool _isInit;
+    size_t _max_size;   //总元素数量
+    size_t _used_size;  //当前的元素个数
+
+    Slot *_slots;
 };
 
-#endif  // HASHTABLE_SEGMENT_MAP_HPP
+/**
+ * 元素就是key时, SegmentSet为只存储key的CompactSegmentSet
+ */
+template <typename Key, Key NIL_KEY, typename GetKeyFn, typename Hash>
+class SegmentSet<Key, NIL_KEY, Key, GetKeyFn, Hash>
+    : public CompactSegmentSet<Key, NIL_KEY, Key, Hash>
+{
+public:
+    SegmentSet(size_t slot_count, int segment_count)
+        : CompactSegmentSet<Key, NIL_KEY, Key, Hash>(slot_count, segment_count) {}
+};
 
 #endif //HASHTABLE_SEGMENT_SET_HPP
@@ -0,0 +1,525 @@
+///@doc 按核分片的SegmentMap前端
+///key空间按hash分到N个独立的SegmentMap, 每个分片只由自己的线程访问,
+///其他线程通过SPSC队列批量发送请求, 分片之间没有共享的可变状态
+
+#ifndef HASHTABLE_SEGMENT_SHARD_HPP
+#define HASHTABLE_SEGMENT_SHARD_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "hashtable_common.hpp"
+#include "segment_map.hpp"
+
+namespace segment_shard {
+
+enum { CACHE_LINE = 64 };
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+/**
+ * 忙等待的退避: 前SPIN_LIMIT次使用pause, 之后让出CPU.
+ * 线程数多于核数时, 等待的线程不会占满对方需要的时间片
+ */
+class Backoff {
+ public:
+  enum { SPIN_LIMIT = 64 };
+
+  Backoff() : _count(0) {}
+
+  void pause() {
+    if (_count < SPIN_LIMIT) {
+      ++_count;
+      cpu_relax();
+    } else {
+      std::this_thread::yield();
+    }
+  }
+
+  void reset() { _count = 0; }
+
+ private:
+  size_t _count;
+};
+
+/**
+ * 单生产者单消费者环形队列, 容量为2的幂.
+ * 生产者和消费者各自缓存对方的下标, 只有缓存的下标不够用时才读取对方的cache line.
+ * 两组下标之间手动填充一个cache line, C++11的new不保证alignas(64)的对齐
+ */
+template <typename E>
+class SpscRing {
+ public:
+  explicit SpscRing(size_t capacity)
+      : _mask(_round_up(capacity) - 1), _items(new E[_mask + 1]),
+        _head(0), _tail_cache(0), _tail(0), _head_cache(0) {}
+
+  size_t capacity() const { return _mask + 1; }
+
+  /**
+   * 生产者调用, 写入尽可能多的元素, 只发布一次tail
+   * @return 写入的数量
+   */
+  size_t push(const E *items, size_t n) {
+    const size_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail + n - _head_cache > capacity()) {
+      _head_cache = _head.load(std::memory_order_acquire);
+      const size_t room = capacity() - (tail - _head_cache);
+      if (n > room) n = room;
+    }
+
+    for (size_t i = 0; i < n; ++i) _items[(tail + i) & _mask] = items[i];
+    _tail.store(tail + n, std::memory_order_release);
+    return n;
+  }
+
+  /**
+   * 消费者调用
+   * @return 读取的数量
+   */
+  size_t pop(E *out, size_t max) {
+    const size_t head = _head.load(std::memory_order_relaxed);
+    if (_tail_cache - head < max) {
+      _tail_cache = _tail.load(std::memory_order_acquire);
+      if (_tail_cache - head < max) max = _tail_cache - head;
+    }
+
+    for (size_t i = 0; i < max; ++i) out[i] = _items[(head + i) & _mask];
+    _head.store(head + max, std::memory_order_release);
+    return max;
+  }
+
+ private:
+  SpscRing(const SpscRing &);
+  void operator=(const SpscRing &);
+
+  static size_t _round_up(size_t n) {
+    size_t c = 1;
+    while (c < n) c <<= 1;
+    return c;
+  }
+
+  const size_t _mask;
+  std::unique_ptr<E[]> _items;
+  char _pad0[CACHE_LINE];
+
+  // 消费者
+  std::atomic<size_t> _head;
+  size_t _tail_cache;
+  char _pad1[CACHE_LINE];
+
+  // 生产者
+  std::atomic<size_t> _tail;
+  size_t _head_cache;
+  char _pad2[CACHE_LINE];
+};
+
+}  // namespace segment_shard
+
+/**
+ * N个分片, 每个分片是一个独立的SegmentMap, 由start()创建的线程独占.
+ * 分片的SegmentMap在分片线程中构造, 内存分配在该线程所在的NUMA节点上.
+ * 路由使用mix64(key)的高位, 与各阶的 key % prime 无关.
+ *
+ * 使用方法:
+ *   ShardedSegmentMap<uint64_t, V> m(slot_count, 20, 4);
+ *   m.start({0, 2, 4, 6});
+ *   Producer *p = m.connect();      // 每个生产线程一个
+ *   p->insert_or_update(v); p->erase(k); p->find(k, &result);
+ *   p->sync();                      // 等待之前的请求全部完成
+ *
+ * @param T 同SegmentMap, 需要trivially copyable, 请求按值放入队列
+ * @param Hash 分片内SegmentMap使用的key变换
+ */
+template <typename Key, typename T, Key NIL_KEY = Key(),
+          typename Hash = segment_hash::identity>
+class ShardedSegmentMap {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "ShardedSegmentMap requires trivially copyable T");
+
+ public:
+  typedef SegmentMap<Key, T, NIL_KEY, Hash> map_type;
+  typedef Key key_type;
+  typedef T value_type;
+
+  enum { MAX_SHARD_CNT = 256 };
+  enum { BATCH = 64 };  //生产者本地缓冲和分片线程每次处理的请求数量
+
+  /**
+   * find请求的结果, 由分片线程填写. done为true之前不能读取
+   */
+  struct Result {
+    std::atomic<bool> done;
+    bool found;
+    T value;
+
+    Result() : done(false), found(false) {}
+
+    void wait() const {
+      segment_shard::Backoff backoff;
+      while (!done.load(std::memory_order_acquire)) backoff.pause();
+    }
+  };
+
+ private:
+  enum Op { OP_INSERT_NEW, OP_INSERT_OR_UPDATE, OP_ERASE, OP_FIND, OP_SYNC };
+
+  struct Request {
+    Op op;
+    T value;  // erase/find时只有key有效
+    Result *result;
+  };
+
+  typedef segment_shard::SpscRing<Request> ring_type;
+
+  struct Shard {
+    std::unique_ptr<map_type> map;
+    std::vector<std::unique_ptr<ring_type> > inbox;  //每个生产者一个
+
+    //分片线程发布的状态, 其他线程只读
+    std::atomic<size_t> size;
+    std::atomic<size_t> failed;  //无法插入的请求数量
+
+    //由其他线程放入, 在分片线程中执行的任务(遍历等)
+    std::atomic<const std::function<void(map_type &)> *> task;
+
+    std::thread thread;
+    char pad[segment_shard::CACHE_LINE];  //避免相邻分片的状态在同一个cache line
+
+    Shard() : size(0), failed(0), task(NULL) {}
+  };
+
+ public:
+  /**
+   * 生产者句柄, 只能在一个线程中使用.
+   * 请求先写入本地缓冲, 缓冲满BATCH个或者调用flush时批量写入分片队列
+   */
+  class Producer {
+   public:
+    bool insert_new(const T &v) { return _send(OP_INSERT_NEW, v, NULL); }
+
+    bool insert_or_update(const T &v) {
+      return _send(OP_INSERT_OR_UPDATE, v, NULL);
+    }
+
+    bool erase(const Key key) {
+      T v;
+      v.setKey(key);
+      return _send(OP_ERASE, v, NULL);
+    }
+
+    /**
+     * 异步查找, 在result->wait()之后读取结果.
+     * 会立即flush对应分片的缓冲
+     */
+    bool find(const Key key, Result *result) {
+      T v;
+      v.setKey(key);
+      result->done.store(false, std::memory_order_relaxed);
+      if (!_send(OP_FIND, v, result)) return false;
+      _flush(_owner->shard_of(key));
+      return true;
+    }
+
+    // 把所有缓冲的请求写入分片队列, 队列满时等待
+    void flush() {
+      for (size_t s = 0; s < _pending.size(); ++s) _flush(s);
+    }
+
+    // flush并等待所有分片处理完之前的请求
+    void sync() {
+      std::vector<Result> done(_pending.size());
+      for (size_t s = 0; s < _pending.size(); ++s) {
+        Request r = {OP_SYNC, T(), &done[s]};
+        _pending[s].push_back(r);
+        _flush(s);
+      }
+      for (size_t s = 0; s < done.size(); ++s) done[s].wait();
+    }
+
+   private:
+    Producer(ShardedSegmentMap *owner, size_t id)
+        : _owner(owner), _id(id), _pending(owner->shard_count()) {
+      for (size_t s = 0; s < _pending.size(); ++s) _pending[s].reserve(BATCH);
+    }
+
+    bool _send(Op op, const T &v, Result *result) {
+      if (v.getKey() == NIL_KEY) return false;
+
+      const size_t s = _owner->shard_of(v.getKey());
+      Request r = {op, v, result};
+      _pending[s].push_back(r);
+      if (_pending[s].size() >= BATCH) _flush(s);
+      return true;
+    }
+
+    void _flush(size_t s) {
+      std::vector<Request> &p = _pending[s];
+      ring_type &ring = *_owner->_shards[s].inbox[_id];
+      segment_shard::Backoff backoff;
+      for (size_t sent = 0; sent < p.size();) {
+        size_t n = ring.push(p.data() + sent, p.size() - sent);
+        if (n == 0) backoff.pause();
+        sent += n;
+      }
+      p.clear();
+    }
+
+    ShardedSegmentMap *_owner;
+    size_t _id;
+    std::vector<std::vector<Request> > _pending;
+
+    friend class ShardedSegmentMap;
+  };
+
+ public:
+  /**
+   * @param slot_count 所有分片的slot总数
+   * @param segment_count 每个分片的阶数量
+   * @param shard_count 分片数量, 一般等于使用的核数
+   * @param max_producers 最多可以connect的生产者数量
+   * @param ring_capacity 每个生产者到每个分片的队列长度
+   * @throw std::invalid_argument 每个分片的slot数量不足以分出segment_count个阶.
+   *        分片的map在分片线程中创建, 需要在这里提前检查
+   */
+  ShardedSegmentMap(size_t slot_count, int segment_count, size_t shard_count,
+                    size_t max_producers = 16, size_t ring_capacity = 4096)
+      : _slot_count(slot_count), _stage(segment_count),
+        _shards(shard_count), _producers(0), _running(false) {
+    assert(shard_count > 0 && shard_count <= MAX_SHARD_CNT);
+    SegmentBucket buckets[map_type::MAX_SEGMENT_CNT];
+    if (_stage == 0 || _stage > map_type::MAX_SEGMENT_CNT ||
+        init_segment_buckets(_slot_count / shard_count, _stage, buckets) == 0)
+      throw std::invalid_argument(
+          "ShardedSegmentMap: too few slots per shard for segment_count");
+
+    for (size_t s = 0; s < shard_count; ++s) {
+      _shards[s].inbox.resize(max_producers);
+      for (size_t p = 0; p < max_producers; ++p)
+        _shards[s].inbox[p].reset(new ring_type(ring_capacity));
+    }
+    _handles.resize(max_producers);
+  }
+
+  ~ShardedSegmentMap() { stop(); }
+
+ private:
+  ShardedSegmentMap(const ShardedSegmentMap &);
+  void operator=(const ShardedSegmentMap &);
+
+ public:
+  size_t shard_count() const { return _shards.size(); }
+
+  // 与各阶的取模无关, 顺序key也能均匀分布
+  size_t shard_of(const Key key) const {
+    return fastrange64(mix64((uint64_t)key), _shards.size());
+  }
+
+  /**
+   * 启动分片线程, 返回时所有分片已经初始化
+   * @param cpus 非空时第i个分片绑定到cpus[i % cpus.size()]
+   */
+  void start(const std::vector<int> &cpus = std::vector<int>()) {
+    std::lock_guard<std::mutex> guard(_control);
+    assert(!_running);
+    _running.store(true);
+    std::atomic<size_t> ready(0);
+    for (size_t s = 0; s < _shards.size(); ++s) {
+      const int cpu = cpus.empty() ? -1 : cpus[s % cpus.size()];
+      _shards[s].thread = std::thread([this, s, cpu, &ready]() {
+        _pin(cpu);
+        _shards[s].map.reset(
+            new map_type(_slot_count / _shards.size(), (int)_stage));
+        ready.fetch_add(1);
+        _run(_shards[s]);
+      });
+    }
+    while (ready.load() < _shards.size()) std::this_thread::yield();
+  }
+
+  /**
+   * 处理完队列中的请求后停止分片线程. 停止前需要所有生产者flush
+   */
+  void stop() {
+    std::lock_guard<std::mutex> guard(_control);
+    if (!_running.exchange(false)) return;
+    for (size_t s = 0; s < _shards.size(); ++s) _shards[s].thread.join();
+  }
+
+  /**
+   * 获取一个生产者句柄, 线程安全. 超过max_producers时返回NULL
+   */
+  Producer *connect() {
+    size_t id = _producers.fetch_add(1);
+    if (id >= _handles.size()) {
+      _producers.fetch_sub(1);
+      return NULL;
+    }
+    _handles[id].reset(new Producer(this, id));
+    return _handles[id].get();
+  }
+
+  /**
+   * 所有分片元素数量之和. 分片每处理一批请求后更新, 与正在处理的请求之间不是原子的
+   */
+  size_t size() const {
+    size_t n = 0;
+    for (size_t s = 0; s < _shards.size(); ++s)
+      n += _shards[s].size.load(std::memory_order_relaxed);
+    return n;
+  }
+
+  // 因为分片满而无法插入的请求数量
+  size_t failed() const {
+    size_t n = 0;
+    for (size_t s = 0; s < _shards.size(); ++s)
+      n += _shards[s].failed.load(std::memory_order_relaxed);
+    return n;
+  }
+
+  /**
+   * 在每个分片线程中依次执行fn(const map_type &), 返回时全部执行完毕. 线程安全, 多个调用者串行执行.
+   * 每个分片的遍历与该分片的请求串行执行, 不同分片之间不是同一时刻的视图.
+   * 没有运行时在调用线程中执行: stop()之后分片的数据仍然保留, start()之前没有分片
+   */
+  template <typename Fn>
+  void for_each_shard(Fn fn) {
+    std::lock_guard<std::mutex> guard(_control);
+    if (!_running.load()) {
+      for (size_t s = 0; s < _shards.size(); ++s) {
+        if (_shards[s].map) fn(static_cast<const map_type &>(*_shards[s].map));
+      }
+      return;
+    }
+
+    const std::function<void(map_type &)> task = [&fn](map_type &m) {
+      fn(static_cast<const map_type &>(m));
+    };
+    for (size_t s = 0; s < _shards.size(); ++s) {
+      _shards[s].task.store(&task, std::memory_order_release);
+      segment_shard::Backoff backoff;
+      while (_shards[s].task.load(std::memory_order_acquire) != NULL)
+        backoff.pause();
+    }
+  }
+
+  /**
+   * 遍历所有元素
+   * @param fn void fn(const T &v); 在分片线程中调用
+   */
+  template <typename Fn>
+  void for_each(Fn fn) {
+    for_each_shard([&fn](const map_type &m) {
+      map_type &map = const_cast<map_type &>(m);
+      for (typename map_type::iterator it = map.begin(); it != map.end(); ++it)
+        fn(static_cast<const T &>(*it));
+    });
+  }
+
+ private:
+  static void _pin(int cpu) {
+#ifdef __linux__
+    if (cpu < 0) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpu;
+#endif
+  }
+
+  void _run(Shard &shard) {
+    map_type &map = *shard.map;
+    Request batch[BATCH];
+    size_t failed = 0;
+    segment_shard::Backoff idle;
+
+    for (;;) {
+      // 先读取运行状态, 保证停止前已经写入的请求都会被处理
+      const bool running = _running.load(std::memory_order_acquire);
+      const size_t producers =
+          std::min(_producers.load(std::memory_order_acquire), _handles.size());
+
+      size_t handled = 0;
+      for (size_t p = 0; p < producers; ++p) {
+        size_t n = shard.inbox[p]->pop(batch, BATCH);
+        for (size_t i = 0; i < n; ++i) failed += _apply(map, batch[i]);
+        handled += n;
+      }
+
+      if (handled) {
+        shard.size.store(map.size(), std::memory_order_relaxed);
+        shard.failed.store(failed, std::memory_order_relaxed);
+      }
+
+      const std::function<void(map_type &)> *task =
+          shard.task.load(std::memory_order_acquire);
+      if (task) {
+        (*task)(map);
+        shard.task.store(NULL, std::memory_order_release);
+      }
+
+      if (handled || task) {
+        idle.reset();
+      } else {
+        if (!running) break;
+        idle.pause();
+      }
+    }
+  }
+
+  // @return 无法插入时返回1
+  static size_t _apply(map_type &map, Request &r) {
+    switch (r.op) {
+      case OP_INSERT_NEW:
+        return map.insert_new(r.value).first == map.end();
+      case OP_INSERT_OR_UPDATE:
+        return map.insert_or_update(r.value).first == map.end();
+      case OP_ERASE:
+        map.erase(r.value.getKey());
+        return 0;
+      case OP_FIND: {
+        typename map_type::iterator it = map.find(r.value.getKey());
+        r.result->found = it != map.end();
+        if (r.result->found) r.result->value = *it;
+        r.result->done.store(true, std::memory_order_release);
+        return 0;
+      }
+      case OP_SYNC:
+        r.result->done.store(true, std::memory_order_release);
+        return 0;
+    }
+    return 0;
+  }
+
+  const size_t _slot_count;
+  const size_t _stage;
+
+  std::vector<Shard> _shards;
+  std::vector<std::unique_ptr<Producer> > _handles;
+  std::atomic<size_t> _producers;  //已经connect的生产者数量
+  std::atomic<bool> _running;
+  std::mutex _control;  //串行执行start/stop/for_each_shard
+};
+
+#endif  // HASHTABLE_SEGMENT_SHARD_HPP
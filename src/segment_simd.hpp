@@ -0,0 +1,200 @@
+///@doc 多阶SIMD探测: 单个key一次探测多阶, 或者多个key一次探测同一阶
+///一次计算多阶的下标, gather对应slot后与key比较. 运行时检测CPU, 不支持时由调用方使用标量实现
+
+#ifndef HASHTABLE_SEGMENT_SIMD_HPP
+#define HASHTABLE_SEGMENT_SIMD_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "hashtable_common.hpp"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SEGMENT_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+namespace segment_simd {
+
+enum Level { LEVEL_SCALAR = 0, LEVEL_AVX2, LEVEL_AVX512 };
+
+enum { MAX_LANES = 8 };
+
+static inline Level detect_level() {
+#ifdef SEGMENT_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+    return LEVEL_AVX512;
+  if (__builtin_cpu_supports("avx2")) return LEVEL_AVX2;
+#endif
+  return LEVEL_SCALAR;
+}
+
+static inline Level cpu_level() {
+  static const Level level = detect_level();
+  return level;
+}
+
+/**
+ * 每一阶的取模乘数, 大小和偏移, 每个值扩展为64位方便直接load到向量中.
+ * 数组末尾多出MAX_LANES个元素, 最后一组向量不会越界
+ */
+template <size_t MAX_STAGE>
+struct StageVectors {
+  uint64_t magic[MAX_STAGE + MAX_LANES];
+  uint64_t size[MAX_STAGE + MAX_LANES];
+  uint64_t offset[MAX_STAGE + MAX_LANES];
+
+  void init(const SegmentBucket *buckets, size_t stage) {
+    for (size_t i = 0; i < MAX_STAGE + MAX_LANES; ++i) {
+      const SegmentBucket &b = buckets[i < stage ? i : 0];
+      magic[i] = fastmod_magic(b.size);
+      size[i] = b.size;
+      offset[i] = b.offset;
+    }
+  }
+};
+
+#ifdef SEGMENT_SIMD_X86
+
+/**
+ * 在32位slot数组中查找key, 每次处理4阶.
+ * @param h 计算各阶下标使用的值, 即key经过hash变换后的低32位
+ * @return key所在的阶, 不存在返回-1
+ */
+__attribute__((target("avx2"))) static inline int probe32_avx2(
+    const uint32_t *slots, const uint64_t *magic, const uint64_t *size,
+    const uint64_t *offset, size_t stage, uint32_t key, uint32_t h) {
+  const __m128i needle = _mm_set1_epi32((int)key);
+  const __m256i k = _mm256_set1_epi64x((long long)h);
+
+  for (size_t base = 0; base < stage; base += 4) {
+    __m256i m = _mm256_loadu_si256((const __m256i *)(magic + base));
+    __m256i d = _mm256_loadu_si256((const __m256i *)(size + base));
+    __m256i off = _mm256_loadu_si256((const __m256i *)(offset + base));
+
+    // fastmod_u32: low = magic * key; index = (low * d) >> 64
+    __m256i low = _mm256_add_epi64(
+        _mm256_mul_epu32(m, k),
+        _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(m, 32), k), 32));
+    __m256i plo = _mm256_mul_epu32(low, d);
+    __m256i phi = _mm256_mul_epu32(_mm256_srli_epi64(low, 32), d);
+    __m256i r = _mm256_srli_epi64(
+        _mm256_add_epi64(phi, _mm256_srli_epi64(plo, 32)), 32);
+
+    __m128i v = _mm256_i64gather_epi32((const int *)slots,
+                                       _mm256_add_epi64(r, off), 4);
+    unsigned hit = (unsigned)_mm_movemask_ps(
+        _mm_castsi128_ps(_mm_cmpeq_epi32(v, needle)));
+    if (stage - base < 4) hit &= (1u << (stage - base)) - 1;
+    if (hit) return (int)base + __builtin_ctz(hit);
+  }
+
+  return -1;
+}
+
+/**
+ * 同probe32_avx2, 每次处理8阶
+ */
+__attribute__((target("avx512f,avx512dq"))) static inline int probe32_avx512(
+    const uint32_t *slots, const uint64_t *magic, const uint64_t *size,
+    const uint64_t *offset, size_t stage, uint32_t key, uint32_t h) {
+  const __m256i needle = _mm256_set1_epi32((int)key);
+  const __m512i k = _mm512_set1_epi64((long long)h);
+
+  for (size_t base = 0; base < stage; base += 8) {
+    __m512i m = _mm512_loadu_si512(magic + base);
+    __m512i d = _mm512_loadu_si512(size + base);
+    __m512i off = _mm512_loadu_si512(offset + base);
+
+    __m512i low = _mm512_mullo_epi64(m, k);
+    __m512i plo = _mm512_mul_epu32(low, d);
+    __m512i phi = _mm512_mul_epu32(_mm512_srli_epi64(low, 32), d);
+    __m512i r = _mm512_srli_epi64(
+        _mm512_add_epi64(phi, _mm512_srli_epi64(plo, 32)), 32);
+
+    __m256i v = _mm512_i64gather_epi32(_mm512_add_epi64(r, off),
+                                       (const int *)slots, 4);
+    unsigned hit = (unsigned)_mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpeq_epi32(v, needle)));
+    if (stage - base < 8) hit &= (1u << (stage - base)) - 1;
+    if (hit) return (int)base + __builtin_ctz(hit);
+  }
+
+  return -1;
+}
+
+/**
+ * 多个key的批量探测, 每次处理4个key的同一阶, 一次gather读取4个key的slot.
+ * gather不依赖上一阶的结果, 多阶的读取可以重叠; 所有lane都命中后结束, 否则探测完所有阶.
+ * @param needles 4个key的Slot值
+ * @param hs 4个key经过hash变换后的低32位
+ * @param active 需要查找的lane
+ * @return 命中的lane
+ */
+__attribute__((target("avx2"))) static inline unsigned batch32_avx2(
+    const uint32_t *slots, const uint64_t *magic, const uint64_t *size,
+    const uint64_t *offset, size_t stage, const uint32_t *needles,
+    const uint32_t *hs, unsigned active) {
+  const __m128i needle = _mm_loadu_si128((const __m128i *)needles);
+  const __m256i k = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i *)hs));
+
+  unsigned hit = 0;
+  for (size_t s = 0; s < stage && hit != active; ++s) {
+    __m256i m = _mm256_set1_epi64x((long long)magic[s]);
+    __m256i d = _mm256_set1_epi64x((long long)size[s]);
+    __m256i off = _mm256_set1_epi64x((long long)offset[s]);
+
+    __m256i low = _mm256_add_epi64(
+        _mm256_mul_epu32(m, k),
+        _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(m, 32), k), 32));
+    __m256i plo = _mm256_mul_epu32(low, d);
+    __m256i phi = _mm256_mul_epu32(_mm256_srli_epi64(low, 32), d);
+    __m256i r = _mm256_srli_epi64(
+        _mm256_add_epi64(phi, _mm256_srli_epi64(plo, 32)), 32);
+
+    __m128i v = _mm256_i64gather_epi32((const int *)slots,
+                                       _mm256_add_epi64(r, off), 4);
+    hit |= (unsigned)_mm_movemask_ps(
+        _mm_castsi128_ps(_mm_cmpeq_epi32(v, needle))) & active;
+  }
+
+  return hit;
+}
+
+/**
+ * 同batch32_avx2, 每次处理8个key
+ */
+__attribute__((target("avx512f,avx512dq"))) static inline unsigned batch32_avx512(
+    const uint32_t *slots, const uint64_t *magic, const uint64_t *size,
+    const uint64_t *offset, size_t stage, const uint32_t *needles,
+    const uint32_t *hs, unsigned active) {
+  const __m256i needle = _mm256_loadu_si256((const __m256i *)needles);
+  const __m512i k = _mm512_cvtepu32_epi64(_mm256_loadu_si256((const __m256i *)hs));
+
+  unsigned hit = 0;
+  for (size_t s = 0; s < stage && hit != active; ++s) {
+    __m512i m = _mm512_set1_epi64((long long)magic[s]);
+    __m512i d = _mm512_set1_epi64((long long)size[s]);
+    __m512i off = _mm512_set1_epi64((long long)offset[s]);
+
+    __m512i low = _mm512_mullo_epi64(m, k);
+    __m512i plo = _mm512_mul_epu32(low, d);
+    __m512i phi = _mm512_mul_epu32(_mm512_srli_epi64(low, 32), d);
+    __m512i r = _mm512_srli_epi64(
+        _mm512_add_epi64(phi, _mm512_srli_epi64(plo, 32)), 32);
+
+    __m256i v = _mm512_i64gather_epi32(_mm512_add_epi64(r, off),
+                                       (const int *)slots, 4);
+    hit |= (unsigned)_mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpeq_epi32(v, needle))) & active;
+  }
+
+  return hit;
+}
+
+#endif  // SEGMENT_SIMD_X86
+
+}  // namespace segment_simd
+
+#endif  // HASHTABLE_SEGMENT_SIMD_HPP
@@ -0,0 +1,451 @@
+///@doc 支持一致性快照的分段hash表
+///一个写线程修改时, 读线程可以获取快照并遍历一个稳定的版本.
+///slot按chunk存储, 快照之后写线程第一次修改某个chunk时复制该chunk(copy on write),
+///被替换的chunk在没有快照使用后按epoch回收
+
+#ifndef HASHTABLE_SEGMENT_SNAPSHOT_HPP
+#define HASHTABLE_SEGMENT_SNAPSHOT_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <set>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "hashtable_common.hpp"
+#include "segment_shard.hpp"
+
+/**
+ * 多阶hash, 与SegmentMap相同的布局, 但是slot分为多个chunk.
+ * 只允许一个写线程调用修改方法和find, 任意线程可以调用snapshot().
+ * 没有快照时写操作不会复制chunk, 额外开销为进入/退出写操作时的epoch同步.
+ *
+ * @param T 必须是trivially copyable, 默认构造的对象getKey返回NIL_KEY
+ * @param Hash 同SegmentMap
+ */
+template <typename Key, typename T, Key NIL_KEY = Key(),
+          typename Hash = segment_hash::identity>
+class SnapshotSegmentMap {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "SnapshotSegmentMap requires trivially copyable T");
+
+ public:
+  typedef Key key_type;
+  typedef T value_type;
+
+  enum { npos = -1 };
+  enum { MAX_SEGMENT_CNT = 64 };
+
+ private:
+  // chunk头部, slot紧跟在头部之后.
+  // C++11的new不保证alignas(64)的对齐, 手动填充到一个cache line,
+  // slot的对齐与operator new返回的地址相同
+  struct Chunk {
+    uint64_t epoch;  //创建(复制)时的epoch
+    Chunk *prev;     //复制前的版本, 创建快照时用于找回旧版本
+    uint64_t retire_epoch;  //被替换时的epoch, 只有epoch不大于它的快照会使用
+    Chunk *next_retired;
+    char _pad[segment_shard::CACHE_LINE - 2 * sizeof(uint64_t) -
+              2 * sizeof(Chunk *)];
+
+    T *slots() { return reinterpret_cast<T *>(this + 1); }
+    const T *slots() const { return reinterpret_cast<const T *>(this + 1); }
+  };
+  static_assert(sizeof(Chunk) == segment_shard::CACHE_LINE,
+                "chunk header must fill one cache line");
+  static_assert(alignof(T) <= alignof(std::max_align_t),
+                "operator new does not guarantee over-aligned slots");
+
+ public:
+  /**
+   * 读线程持有的只读版本, 析构时释放.
+   * 快照之间以及与写线程之间不共享可变状态, 可以在任意线程中使用
+   */
+  class Snapshot {
+   public:
+    Snapshot() : _map(NULL), _epoch(0) {}
+
+    Snapshot(Snapshot &&o)
+        : _map(o._map), _epoch(o._epoch), _chunks(std::move(o._chunks)) {
+      o._map = NULL;
+    }
+
+    Snapshot &operator=(Snapshot &&o) {
+      if (this != &o) {
+        release();
+        _map = o._map;
+        _epoch = o._epoch;
+        _chunks = std::move(o._chunks);
+        o._map = NULL;
+      }
+      return *this;
+    }
+
+    ~Snapshot() { release(); }
+
+    bool valid() const { return _map != NULL; }
+
+    uint64_t epoch() const { return _epoch; }
+
+    /**
+     * @return 元素指针, 不存在时返回NULL
+     */
+    const T *find(const Key key) const {
+      if (key == NIL_KEY) return NULL;
+
+      for (size_t i = 0; i < _map->_stage; ++i) {
+        const T *p = _slot(_map->_slot_index(key, i));
+        if (p->getKey() == key) return p;
+      }
+      return NULL;
+    }
+
+    /**
+     * 遍历所有元素
+     * @param fn void fn(const T &v);
+     */
+    template <typename Fn>
+    void for_each(Fn fn) const {
+      for (size_t c = 0; c < _chunks.size(); ++c) {
+        const T *slots = _chunks[c]->slots();
+        const size_t n = _map->_chunk_size(c);
+        for (size_t i = 0; i < n; ++i) {
+          if (slots[i].getKey() != NIL_KEY) fn(slots[i]);
+        }
+      }
+    }
+
+    // 元素数量, 需要遍历所有slot
+    size_t size() const {
+      size_t n = 0;
+      for_each([&n](const T &) { ++n; });
+      return n;
+    }
+
+    void release() {
+      if (_map) _map->_release(_epoch);
+      _map = NULL;
+      _chunks.clear();
+    }
+
+   private:
+    Snapshot(const Snapshot &);
+    void operator=(const Snapshot &);
+
+    const T *_slot(size_t index) const {
+      return _chunks[index >> _map->_shift]->slots() + (index & _map->_mask);
+    }
+
+    const SnapshotSegmentMap *_map;
+    uint64_t _epoch;
+    std::vector<const Chunk *> _chunks;
+
+    friend class SnapshotSegmentMap;
+  };
+
+ public:
+  /**
+   * @param slot_count 同SegmentMap
+   * @param segment_count 同SegmentMap
+   * @param chunk_slots 复制的粒度, 向上取整为2的幂
+   * @throw std::invalid_argument 同SegmentMap
+   */
+  SnapshotSegmentMap(size_t slot_count, int segment_count,
+                     size_t chunk_slots = 1024)
+      : _stage(segment_count), _shift(0), _used_size(0), _epoch(1),
+        _active(0), _retired(NULL) {
+    _max_size = _stage == 0 || _stage > MAX_SEGMENT_CNT
+                    ? 0
+                    : init_segment_buckets(slot_count, _stage, _buckets);
+    if (_max_size == 0)
+      throw std::invalid_argument(
+          "SnapshotSegmentMap: too few slots for segment_count");
+
+    while (((size_t)1 << _shift) < chunk_slots) ++_shift;
+    _mask = ((size_t)1 << _shift) - 1;
+
+    _table = std::vector<std::atomic<Chunk *> >((_max_size + _mask) >> _shift);
+    for (size_t c = 0; c < _table.size(); ++c) {
+      Chunk *p = _alloc(c, 1);
+      for (size_t i = 0; i < _chunk_size(c); ++i) ::new (p->slots() + i) T();
+      _table[c].store(p, std::memory_order_relaxed);
+    }
+  }
+
+  // 析构前必须释放所有快照
+  ~SnapshotSegmentMap() {
+    assert(_live.empty());
+    for (size_t c = 0; c < _table.size(); ++c)
+      _free(_table[c].load(std::memory_order_relaxed));
+    _reclaim(true);
+  }
+
+ private:
+  SnapshotSegmentMap(const SnapshotSegmentMap &);
+  void operator=(const SnapshotSegmentMap &);
+
+ public:
+  size_t stage() const { return _stage; }
+
+  bool empty() const { return _used_size == 0; }
+
+  size_t size() const { return _used_size; }
+
+  size_t max_size() const { return _max_size; }
+
+  size_t chunk_slots() const { return _mask + 1; }
+
+  /**
+   * 只能在写线程中调用
+   * @return 元素指针, 不存在时返回NULL
+   */
+  const T *find(const Key key) const {
+    if (key == NIL_KEY) return NULL;
+
+    size_t index = _find_index(key);
+    return index == (size_t)npos ? NULL : _slot(index);
+  }
+
+  /**
+   * @return 插入成功返回true, 已经存在或者无法插入返回false
+   */
+  bool insert_new(const T &v) {
+    const Key key = v.getKey();
+    if (key == NIL_KEY) return false;
+
+    WriteScope w(this);
+    std::pair<size_t, bool> r = _probe(key);
+    if (r.first == (size_t)npos || r.second) return false;
+
+    *_writable(r.first, w.epoch) = v;
+    ++_used_size;
+    return true;
+  }
+
+  /**
+   * @return 同SegmentMap::insert_or_update, 插入返回(true, true),
+   * 更新返回(true, false), 无法插入返回(false, false)
+   */
+  std::pair<bool, bool> insert_or_update(const T &v) {
+    const Key key = v.getKey();
+    if (key == NIL_KEY) return std::make_pair(false, false);
+
+    WriteScope w(this);
+    std::pair<size_t, bool> r = _probe(key);
+    if (r.first == (size_t)npos) return std::make_pair(false, false);
+
+    *_writable(r.first, w.epoch) = v;
+    if (r.second) return std::make_pair(true, false);
+
+    ++_used_size;
+    return std::make_pair(true, true);
+  }
+
+  /**
+   * 原地修改元素
+   * @param fn void fn(T &v); fn不能修改元素的key
+   * @return 元素不存在时返回false
+   */
+  template <typename Fn>
+  bool modify(const Key key, Fn fn) {
+    if (key == NIL_KEY) return false;
+
+    WriteScope w(this);
+    size_t index = _find_index(key);
+    if (index == (size_t)npos) return false;
+
+    fn(*_writable(index, w.epoch));
+    return true;
+  }
+
+  bool erase(const Key key) {
+    if (key == NIL_KEY) return false;
+
+    WriteScope w(this);
+    size_t index = _find_index(key);
+    if (index == (size_t)npos) return false;
+
+    _writable(index, w.epoch)->setKey(NIL_KEY);
+    --_used_size;
+    return true;
+  }
+
+  /**
+   * 获取当前版本的快照, 可以在任意线程调用.
+   * 只会等待写线程完成正在进行的一次操作, 快照期间写线程不会阻塞
+   */
+  Snapshot snapshot() const {
+    Snapshot s;
+    {
+      std::lock_guard<std::mutex> guard(_lock);
+      s._epoch = _epoch.fetch_add(1) + 1;
+      _live.insert(s._epoch);
+      _reclaim(false);
+    }
+    s._map = this;
+
+    // 等待使用旧epoch的写操作结束, 之后的写操作都会复制epoch小于快照的chunk
+    segment_shard::Backoff backoff;
+    for (;;) {
+      uint64_t a = _active.load();
+      if (a == 0 || a >= s._epoch) break;
+      backoff.pause();
+    }
+
+    s._chunks.resize(_table.size());
+    for (size_t c = 0; c < _table.size(); ++c) {
+      const Chunk *p = _table[c].load(std::memory_order_acquire);
+      while (p->epoch >= s._epoch) p = p->prev;
+      s._chunks[c] = p;
+    }
+    return s;
+  }
+
+ private:
+  /**
+   * 写操作期间在_active中发布使用的epoch.
+   * 发布后重新检查epoch, 与snapshot()中的递增epoch配合,
+   * 保证快照开始后写线程不会再原地修改旧chunk
+   */
+  struct WriteScope {
+    explicit WriteScope(const SnapshotSegmentMap *m) : map(m) {
+      for (;;) {
+        epoch = map->_epoch.load();
+        map->_active.exchange(epoch);
+        if (map->_epoch.load() == epoch) break;
+      }
+    }
+
+    ~WriteScope() { map->_active.store(0, std::memory_order_release); }
+
+    const SnapshotSegmentMap *map;
+    uint64_t epoch;
+  };
+
+  size_t _slot_index(const Key key, size_t stage) const {
+    return (Hash::hash(key, stage) % _buckets[stage].size) +
+           _buckets[stage].offset;
+  }
+
+  size_t _chunk_size(size_t c) const {
+    const size_t first = c << _shift;
+    return first + _mask + 1 <= _max_size ? _mask + 1 : _max_size - first;
+  }
+
+  const T *_slot(size_t index) const {
+    return _table[index >> _shift].load(std::memory_order_relaxed)->slots() +
+           (index & _mask);
+  }
+
+  size_t _find_index(const Key key) const {
+    for (size_t i = 0; i < _stage; ++i) {
+      size_t index = _slot_index(key, i);
+      if (_slot(index)->getKey() == key) return index;
+    }
+    return npos;
+  }
+
+  std::pair<size_t, bool> _probe(const Key key) const {
+    for (size_t i = 0; i < _stage; ++i) {
+      size_t index = _slot_index(key, i);
+      Key slotKey = _slot(index)->getKey();
+      if (slotKey == NIL_KEY) return {index, false};
+
+      if (slotKey == key)  // find same element
+        return {index, true};
+    }
+
+    return {npos, false};
+  }
+
+  // chunk的epoch小于当前写操作的epoch时, 可能被快照使用, 先复制
+  T *_writable(size_t index, uint64_t epoch) {
+    const size_t c = index >> _shift;
+    Chunk *p = _table[c].load(std::memory_order_relaxed);
+    if (p->epoch != epoch) {
+      Chunk *n = _alloc(c, epoch);
+      memcpy(static_cast<void *>(n->slots()), p->slots(),
+             _chunk_size(c) * sizeof(T));
+      n->prev = p;
+      _table[c].store(n, std::memory_order_release);
+      _retire(p, epoch);
+      p = n;
+    }
+    return p->slots() + (index & _mask);
+  }
+
+  Chunk *_alloc(size_t c, uint64_t epoch) const {
+    void *mem = ::operator new(sizeof(Chunk) + _chunk_size(c) * sizeof(T));
+    Chunk *p = ::new (mem) Chunk();
+    p->epoch = epoch;
+    p->prev = NULL;
+    p->retire_epoch = 0;
+    p->next_retired = NULL;
+    return p;
+  }
+
+  static void _free(Chunk *p) { ::operator delete(static_cast<void *>(p)); }
+
+  void _retire(Chunk *p, uint64_t epoch) {
+    p->retire_epoch = epoch;
+    p->next_retired = _retired.load(std::memory_order_relaxed);
+    while (!_retired.compare_exchange_weak(p->next_retired, p,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed)) {
+    }
+  }
+
+  /**
+   * 回收没有快照使用的chunk, 调用时持有_lock(析构时除外)
+   */
+  void _reclaim(bool all) const {
+    Chunk *p = _retired.exchange(NULL, std::memory_order_acquire);
+    const uint64_t min_live = _live.empty() ? UINT64_MAX : *_live.begin();
+    while (p) {
+      Chunk *next = p->next_retired;
+      if (all || p->retire_epoch < min_live) {
+        _free(p);
+      } else {
+        p->next_retired = _retired.load(std::memory_order_relaxed);
+        while (!_retired.compare_exchange_weak(p->next_retired, p,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed)) {
+        }
+      }
+      p = next;
+    }
+  }
+
+  void _release(uint64_t epoch) const {
+    std::lock_guard<std::mutex> guard(_lock);
+    _live.erase(_live.find(epoch));
+    _reclaim(false);
+  }
+
+  SegmentBucket _buckets[MAX_SEGMENT_CNT];  //存储每阶段大小,和偏移值
+
+  size_t _stage;     //阶数量
+  size_t _shift;     // chunk_slots = 1 << _shift
+  size_t _mask;
+  size_t _max_size;  //总元素数量
+  size_t _used_size; //当前的元素个数, 只有写线程访问
+
+  std::vector<std::atomic<Chunk *> > _table;  //每个chunk的当前版本
+
+  mutable std::atomic<uint64_t> _epoch;   //快照时递增
+  mutable std::atomic<uint64_t> _active;  //写操作使用的epoch, 0表示空闲
+  mutable std::atomic<Chunk *> _retired;  //等待回收的chunk
+
+  mutable std::mutex _lock;  //保护_live
+  mutable std::multiset<uint64_t> _live;  //未释放快照的epoch
+};
+
+#endif  // HASHTABLE_SEGMENT_SNAPSHOT_HPP
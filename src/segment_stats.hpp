@@ -0,0 +1,253 @@
+///@doc SegmentMap 操作延迟统计
+///定义 SEGMENT_MAP_LATENCY_STATS 后开启, 否则不会编译进代码
+
+#ifndef HASHTABLE_SEGMENT_STATS_HPP
+#define HASHTABLE_SEGMENT_STATS_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+//每N次操作采样一次, 必须为2的幂
+#ifndef SEGMENT_MAP_LATENCY_SAMPLE
+#define SEGMENT_MAP_LATENCY_SAMPLE 64
+#endif
+
+/**
+ * 按操作类型统计的延迟直方图(单位为cycle).
+ * 每个线程写自己的thread local直方图, 读取时合并所有线程.
+ * 桶的划分类似HDR histogram: 按2的幂分段, 每段再等分为SUB_BUCKETS个桶,
+ * 相对误差不超过 1/SUB_BUCKETS.
+ */
+namespace segment_stats {
+
+enum Op {
+  OP_FIND = 0,
+  OP_INSERT_NEW,
+  OP_INSERT_OR_UPDATE,
+  OP_INSERT_OR_REPLACE,
+  OP_UPSERT,
+  OP_ERASE,
+  OP_ITERATE,
+  OP_CLEAR,
+  OP_COUNT
+};
+
+enum {
+  SUB_BUCKET_BITS = 3,
+  SUB_BUCKETS = 1 << SUB_BUCKET_BITS,
+  BUCKET_COUNT = 64 * SUB_BUCKETS
+};
+
+static inline const char *op_name(Op op) {
+  static const char *names[OP_COUNT] = {
+      "find",  "insert_new", "insert_or_update", "insert_or_replace",
+      "upsert", "erase",     "iterate",          "clear"};
+  return names[op];
+}
+
+static inline uint64_t now_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+//值到桶下标: 小于SUB_BUCKETS的值直接对应, 其余按最高位分段
+static inline size_t bucket_of(uint64_t v) {
+  if (v < SUB_BUCKETS) return v;
+
+  const int msb = 63 - __builtin_clzll(v);
+  const int shift = msb - SUB_BUCKET_BITS;
+  return ((shift + 1) << SUB_BUCKET_BITS) + ((v >> shift) & (SUB_BUCKETS - 1));
+}
+
+//桶的下界
+static inline uint64_t bucket_value(size_t b) {
+  if (b < SUB_BUCKETS) return b;
+
+  const int shift = (int)(b >> SUB_BUCKET_BITS) - 1;
+  return (uint64_t)(SUB_BUCKETS + (b & (SUB_BUCKETS - 1))) << shift;
+}
+
+/**
+ * 合并后的直方图
+ */
+struct Histogram {
+  uint64_t counts[BUCKET_COUNT];
+  uint64_t total;
+
+  Histogram() { reset(); }
+
+  void reset() {
+    for (size_t i = 0; i < BUCKET_COUNT; ++i) counts[i] = 0;
+    total = 0;
+  }
+
+  /**
+   * @param p 百分位 0~100, 例如 99.9
+   * @return 该百分位对应桶的下界(cycle), 没有样本时返回0
+   */
+  uint64_t percentile(double p) const {
+    if (total == 0) return 0;
+
+    uint64_t rank = (uint64_t)(p / 100.0 * total);
+    if (rank >= total) rank = total - 1;
+
+    uint64_t acc = 0;
+    for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+      acc += counts[i];
+      if (acc > rank) return bucket_value(i);
+    }
+    return 0;
+  }
+
+  uint64_t max() const {
+    for (size_t i = BUCKET_COUNT; i > 0; --i) {
+      if (counts[i - 1]) return bucket_value(i - 1);
+    }
+    return 0;
+  }
+};
+
+/**
+ * 线程自己的直方图, 只有所属线程写入, 读线程使用relaxed读取
+ */
+struct ThreadHistograms {
+  std::atomic<uint64_t> counts[OP_COUNT][BUCKET_COUNT];
+  uint32_t tick;
+
+  ThreadHistograms() : tick(0) {
+    for (size_t op = 0; op < OP_COUNT; ++op)
+      for (size_t i = 0; i < BUCKET_COUNT; ++i)
+        counts[op][i].store(0, std::memory_order_relaxed);
+  }
+
+  ~ThreadHistograms();
+
+  void record(Op op, uint64_t cycles) {
+    std::atomic<uint64_t> &c = counts[op][bucket_of(cycles)];
+    c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+  void merge_to(Op op, Histogram &h) const {
+    for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+      uint64_t n = counts[op][i].load(std::memory_order_relaxed);
+      h.counts[i] += n;
+      h.total += n;
+    }
+  }
+
+  void clear() {
+    for (size_t op = 0; op < OP_COUNT; ++op)
+      for (size_t i = 0; i < BUCKET_COUNT; ++i)
+        counts[op][i].store(0, std::memory_order_relaxed);
+  }
+};
+
+/**
+ * 所有线程的直方图, 线程退出时的数据合并到retired中
+ */
+struct Registry {
+  std::mutex lock;
+  std::vector<ThreadHistograms *> threads;
+  Histogram retired[OP_COUNT];
+
+  static Registry &instance() {
+    static Registry *r = new Registry();  // never destroyed
+    return *r;
+  }
+};
+
+inline ThreadHistograms::~ThreadHistograms() {
+  Registry &r = Registry::instance();
+  std::lock_guard<std::mutex> guard(r.lock);
+  for (size_t op = 0; op < OP_COUNT; ++op) merge_to((Op)op, r.retired[op]);
+  for (size_t i = 0; i < r.threads.size(); ++i) {
+    if (r.threads[i] == this) {
+      r.threads[i] = r.threads.back();
+      r.threads.pop_back();
+      break;
+    }
+  }
+}
+
+static inline ThreadHistograms &local() {
+  static thread_local ThreadHistograms *h = NULL;
+  if (h == NULL) {
+    static thread_local ThreadHistograms storage;
+    h = &storage;
+
+    Registry &r = Registry::instance();
+    std::lock_guard<std::mutex> guard(r.lock);
+    r.threads.push_back(h);
+  }
+  return *h;
+}
+
+/**
+ * 合并所有线程的op直方图
+ */
+static inline Histogram collect(Op op) {
+  Histogram h;
+  Registry &r = Registry::instance();
+  std::lock_guard<std::mutex> guard(r.lock);
+  for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+    h.counts[i] = r.retired[op].counts[i];
+  }
+  h.total = r.retired[op].total;
+  for (size_t i = 0; i < r.threads.size(); ++i) r.threads[i]->merge_to(op, h);
+  return h;
+}
+
+/**
+ * 清空统计. 与写线程并发调用时可能丢失少量样本
+ */
+static inline void reset() {
+  Registry &r = Registry::instance();
+  std::lock_guard<std::mutex> guard(r.lock);
+  for (size_t op = 0; op < OP_COUNT; ++op) r.retired[op].reset();
+  for (size_t i = 0; i < r.threads.size(); ++i) r.threads[i]->clear();
+}
+
+/**
+ * 作用域计时, 每SEGMENT_MAP_LATENCY_SAMPLE次采样一次
+ */
+class LatencyScope {
+ public:
+  explicit LatencyScope(Op op) : _op(op), _start(0) {
+    ThreadHistograms &h = local();
+    if ((h.tick++ & (SEGMENT_MAP_LATENCY_SAMPLE - 1)) == 0) {
+      _hist = &h;
+      _start = now_cycles();
+    } else {
+      _hist = NULL;
+    }
+  }
+
+  ~LatencyScope() {
+    if (_hist) _hist->record(_op, now_cycles() - _start);
+  }
+
+ private:
+  LatencyScope(const LatencyScope &);
+  void operator=(const LatencyScope &);
+
+  Op _op;
+  ThreadHistograms *_hist;
+  uint64_t _start;
+};
+
+}  // namespace segment_stats
+
+#endif  // HASHTABLE_SEGMENT_STATS_HPP
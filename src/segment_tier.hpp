@@ -0,0 +1,148 @@
+///@doc SegmentMap 冷热分层存储
+///前几阶(热)使用匿名内存, 后面的阶(冷)映射到文件, 由page cache决定是否常驻内存.
+///两部分在同一段连续的虚拟地址上, 查找代码不需要区分
+
+#ifndef HASHTABLE_SEGMENT_TIER_HPP
+#define HASHTABLE_SEGMENT_TIER_HPP
+
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <new>
+#include <type_traits>
+
+namespace segment_tier {
+
+/**
+ * 一段连续的虚拟地址: [base, base+hot_bytes)为匿名内存,
+ * [base+hot_bytes, base+bytes)为MAP_SHARED映射的文件. 两部分初始内容都为0
+ */
+class TieredRegion {
+ public:
+  TieredRegion() : _base(NULL), _bytes(0), _hot_bytes(0) {}
+
+  ~TieredRegion() { close(); }
+
+  bool mapped() const { return _base != NULL; }
+
+  void *base() const { return _base; }
+
+  size_t hot_bytes() const { return _hot_bytes; }
+
+  size_t cold_bytes() const { return _bytes - _hot_bytes; }
+
+  /**
+   * @param path 冷数据文件, 会被截断重建
+   * @param bytes 总大小
+   * @param hot_bytes 热数据大小, 向上取整到页大小
+   * @return 成功返回0, 失败返回-1
+   */
+  int open(const char *path, size_t bytes, size_t hot_bytes) {
+    close();
+
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    bytes = (bytes + page - 1) / page * page;
+    hot_bytes = (hot_bytes + page - 1) / page * page;
+    if (hot_bytes > bytes) hot_bytes = bytes;
+
+    void *base = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) return -1;
+
+    const size_t cold = bytes - hot_bytes;
+    if (cold) {
+      int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+      if (fd < 0) {
+        munmap(base, bytes);
+        return -1;
+      }
+
+      void *p = MAP_FAILED;
+      if (ftruncate(fd, (off_t)cold) == 0) {
+        p = mmap((char *)base + hot_bytes, cold, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, fd, 0);
+      }
+      ::close(fd);  // 映射会保留文件的引用
+      if (p == MAP_FAILED) {
+        munmap(base, bytes);
+        return -1;
+      }
+
+      // 冷数据是随机访问, 关闭预读
+      madvise(p, cold, MADV_RANDOM);
+    }
+
+    _base = base;
+    _bytes = bytes;
+    _hot_bytes = hot_bytes;
+    return 0;
+  }
+
+  void close() {
+    if (_base) munmap(_base, _bytes);
+    _base = NULL;
+    _bytes = _hot_bytes = 0;
+  }
+
+ private:
+  TieredRegion(const TieredRegion &);
+  void operator=(const TieredRegion &);
+
+  void *_base;
+  size_t _bytes;
+  size_t _hot_bytes;
+};
+
+/**
+ * SegmentMap的Storage策略, 开启SegmentMap::init_tiered:
+ *   SegmentMap<Key, T, NIL_KEY, Hash, Tracker, segment_tier::TieredStorage>
+ * 没有调用init_tiered时与默认策略相同, 使用普通内存
+ */
+class TieredStorage {
+ public:
+  bool mapped() const { return _region.mapped(); }
+
+  size_t hot_bytes() const { return _region.hot_bytes(); }
+
+  template <typename T>
+  T *allocate(size_t n) { return new T[n]; }
+
+  /**
+   * 前hot个slot使用匿名内存, 其余映射到文件path
+   * @return 失败返回NULL
+   */
+  template <typename T>
+  T *allocate_tiered(const char *path, size_t n, size_t hot) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "tiered storage requires trivially copyable T");
+
+    if (_region.open(path, n * sizeof(T), hot * sizeof(T)) != 0) return NULL;
+
+    // 映射的内存初始为0, 只有默认构造的T不全为0时才需要构造
+    T *p = static_cast<T *>(_region.base());
+    const T nil = T();
+    static const char zero[sizeof(T)] = {};
+    if (memcmp(&nil, zero, sizeof(T)) != 0) {
+      for (size_t i = 0; i < n; ++i) ::new (p + i) T();
+    }
+    return p;
+  }
+
+  // 映射的T是trivially copyable, 不需要析构
+  template <typename T>
+  void release(T *p) {
+    if (_region.mapped())
+      _region.close();
+    else
+      delete[] p;
+  }
+
+ private:
+  TieredRegion _region;
+};
+
+}  // namespace segment_tier
+
+#endif  // HASHTABLE_SEGMENT_TIER_HPP
@@ -0,0 +1,71 @@
+//
+// 协程查找测试, 需要C++20
+//
+#include <stdint.h>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "../src/segment_map.hpp"
+#include "../src/segment_coro.hpp"
+
+struct Entry {
+    uint64_t id;
+    int value;
+
+    Entry() : id(0), value(0) {}
+    Entry(uint64_t k, int v) : id(k), value(v) {}
+
+    uint64_t getKey() const { return id; }
+    void setKey(uint64_t k) { id = k; }
+};
+
+typedef SegmentMap<uint64_t, Entry> EntryMap;
+
+segment_coro::Task<> handler(segment_coro::Scheduler &sched, EntryMap &map, uint64_t key,
+                             std::vector<int> &out, size_t slot) {
+    EntryMap::iterator it = co_await segment_coro::find_async(sched, map, key);
+    out[slot] = it == map.end() ? -1 : it->value;
+}
+
+TEST(segment_coro, interleaved_find) {
+    EntryMap map(10000, 20);
+    for (uint64_t k = 1; k <= 5000; ++k) map.insert_new(Entry(k * 3, (int)k));
+
+    segment_coro::Scheduler sched;
+    std::vector<int> out(200, 0);
+    for (size_t i = 0; i < out.size(); ++i) {
+        sched.spawn(handler(sched, map, i * 3 + (i % 2), out, i));
+    }
+    sched.run();
+
+    for (size_t i = 0; i < out.size(); ++i) {
+        EntryMap::iterator it = map.find(i * 3 + (i % 2));
+        ASSERT_EQ(it == map.end() ? -1 : it->value, out[i]) << i;
+    }
+    ASSERT_EQ(-1, out[0]);  // NIL_KEY
+    ASSERT_EQ(2, out[2]);
+}
+
+TEST(segment_coro, deep_stages_and_holes) {
+    // 阶数不是PREFETCH_STAGES的整数倍, 也有少于PREFETCH_STAGES阶的表
+    const int stages[] = {3, 7, 20};
+    for (size_t n = 0; n < sizeof(stages) / sizeof(stages[0]); ++n) {
+        EntryMap map(4000, stages[n]);
+        for (uint64_t k = 1; k <= 3500; ++k) map.insert_new(Entry(k, (int)k));
+        // 删除后前面的阶留下空slot, 后面阶的元素仍然要能找到
+        for (uint64_t k = 1; k <= 3500; k += 5) map.erase(k);
+
+        segment_coro::Scheduler sched;
+        std::vector<int> out(4000, 0);
+        for (size_t i = 0; i < out.size(); ++i) sched.spawn(handler(sched, map, i, out, i));
+        sched.run();
+
+        size_t deep = 0;
+        for (size_t i = 0; i < out.size(); ++i) {
+            EntryMap::iterator it = map.find(i);
+            ASSERT_EQ(it == map.end() ? -1 : it->value, out[i]) << stages[n] << " " << i;
+            if (it != map.end() && map.stage_of(it.index()) >= 4) ++deep;
+        }
+        if (stages[n] > 4) ASSERT_GT(deep, 0u);
+    }
+}
@@ -0,0 +1,67 @@
+//
+// 延迟统计开启时的测试
+//
+#define SEGMENT_MAP_LATENCY_STATS
+#define SEGMENT_MAP_LATENCY_SAMPLE 1
+
+#include <stdint.h>
+#include <algorithm>
+#include <thread>
+#include <gtest/gtest.h>
+
+#include "../src/segment_map.hpp"
+
+struct Item {
+    uint64_t id;
+
+    Item() : id(0) {}
+    explicit Item(uint64_t k) : id(k) {}
+
+    uint64_t getKey() const { return id; }
+    void setKey(uint64_t k) { id = k; }
+};
+
+TEST(segment_stats, bucket) {
+    for (uint64_t v = 0; v < 100000; v = v * 3 / 2 + 1) {
+        size_t b = segment_stats::bucket_of(v);
+        ASSERT_LT(b, (size_t)segment_stats::BUCKET_COUNT);
+        ASSERT_LE(segment_stats::bucket_value(b), v);
+        ASSERT_LT(v, segment_stats::bucket_value(b + 1));
+        // 相对误差不超过 1/SUB_BUCKETS
+        ASSERT_LE(segment_stats::bucket_value(b + 1) - segment_stats::bucket_value(b),
+                  std::max<uint64_t>(1, segment_stats::bucket_value(b) / segment_stats::SUB_BUCKETS));
+    }
+    ASSERT_LT(segment_stats::bucket_of(UINT64_MAX), (size_t)segment_stats::BUCKET_COUNT);
+}
+
+TEST(segment_stats, record_and_merge_threads) {
+    segment_stats::reset();
+
+    SegmentMap<uint64_t, Item> map(1000, 4);
+    for (uint64_t k = 1; k <= 100; ++k) map.insert_new(Item(k));
+
+    std::thread t([&map]() {
+        for (uint64_t k = 1; k <= 100; ++k) map.find(k);
+    });
+    t.join();
+    for (uint64_t k = 1; k <= 50; ++k) map.find(k);
+    map.erase(1);
+    map.count(2);
+    map.modify(3, [](Item &) {});
+    map.clear();
+
+    // 只记录用户直接调用的find, erase/count/modify/clear不会重复记录
+    segment_stats::Histogram find = segment_stats::collect(segment_stats::OP_FIND);
+    ASSERT_EQ(150u, find.total);
+    ASSERT_LE(find.percentile(50), find.percentile(99.9));
+    ASSERT_LE(find.percentile(99.9), find.max());
+
+    ASSERT_EQ(100u, segment_stats::collect(segment_stats::OP_INSERT_NEW).total);
+    ASSERT_EQ(1u, segment_stats::collect(segment_stats::OP_ERASE).total);
+    ASSERT_EQ(1u, segment_stats::collect(segment_stats::OP_CLEAR).total);
+    ASSERT_EQ(0u, segment_stats::collect(segment_stats::OP_ITERATE).total);
+    ASSERT_EQ(0u, segment_stats::collect(segment_stats::OP_UPSERT).total);
+
+    segment_stats::reset();
+    ASSERT_EQ(0u, segment_stats::collect(segment_stats::OP_FIND).total);
+}
@@ -1,11 +1,26 @@
 //
 // Created by god on 12/13/18.
 //
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <thread>
 #include <type_traits>
 #include <string>
+#include <vector>
+#include <random>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <gtest/gtest.h>
 
 #include "../src/segment_map.hpp"
+#include "../src/segment_dirty.hpp"
+#include "../src/segment_tier.hpp"
+#include "../src/segment_set.hpp"
+#include "../src/segment_frozen.hpp"
+#include "../src/segment_snapshot.hpp"
+#include "../src/segment_shard.hpp"
+#include "../src/segment_simd.hpp"
 
 TEST(is_prime_num, test) {
   // https://www.isprimenumber.com/between/1-1000
@@ -50,3 +65,914 @@ TEST(sgement_map, test) {
     SegmentMap<int, Value> map(10000,8);
 
 }
+
+struct CountedValue {
+    static int copy_count;
+    static int move_count;
+
+    int key;
+    std::string payload;
+
+    CountedValue() : key(0) {}
+    CountedValue(int k, const std::string &p) : key(k), payload(p) {}
+    CountedValue(const CountedValue &o) : key(o.key), payload(o.payload) { ++copy_count; }
+    CountedValue(CountedValue &&o) : key(o.key), payload(std::move(o.payload)) { ++move_count; }
+    CountedValue &operator=(const CountedValue &o) {
+        key = o.key;
+        payload = o.payload;
+        ++copy_count;
+        return *this;
+    }
+    CountedValue &operator=(CountedValue &&o) {
+        key = o.key;
+        payload = std::move(o.payload);
+        ++move_count;
+        return *this;
+    }
+
+    int getKey() const { return key; }
+    void setKey(int k) { key = k; }
+
+    static void reset() { copy_count = move_count = 0; }
+};
+
+int CountedValue::copy_count = 0;
+int CountedValue::move_count = 0;
+
+TEST(sgement_map, insert_find_erase) {
+    SegmentMap<int, CountedValue> map(10000, 8);
+
+    for (int k = 1; k <= 1000; ++k) {
+        ASSERT_TRUE(map.insert_new(CountedValue(k, "v")).second);
+    }
+    ASSERT_EQ(1000u, map.size());
+    ASSERT_FALSE(map.insert_new(CountedValue(7, "dup")).second);
+    ASSERT_EQ("v", map.find(7)->payload);
+    ASSERT_TRUE(map.find(1001) == map.end());
+
+    ASSERT_TRUE(map.erase(7));
+    ASSERT_FALSE(map.erase(7));
+    ASSERT_EQ(0u, map.count(7));
+    ASSERT_EQ(999u, map.size());
+
+    size_t n = 0;
+    for (SegmentMap<int, CountedValue>::iterator it = map.begin(); it != map.end(); ++it)
+        ++n;
+    ASSERT_EQ(999u, n);
+
+    map.clear();
+    ASSERT_TRUE(map.empty());
+    ASSERT_TRUE(map.begin() == map.end());
+}
+
+TEST(sgement_map, move_and_emplace_do_not_copy) {
+    SegmentMap<int, CountedValue> map(1000, 4);
+    CountedValue::reset();
+
+    CountedValue v(1, std::string(300, 'a'));
+    ASSERT_TRUE(map.insert_new(std::move(v)).second);
+    ASSERT_TRUE(map.insert_or_update(CountedValue(1, "b")).first != map.end());
+    ASSERT_TRUE(map.emplace(2, "c").second);
+    ASSERT_EQ(0, CountedValue::copy_count);
+
+    CountedValue::reset();
+    std::pair<SegmentMap<int, CountedValue>::iterator, bool> r =
+        map.try_emplace(3, 0, "d");
+    ASSERT_TRUE(r.second);
+    ASSERT_EQ(3, r.first->key);
+    ASSERT_EQ("d", r.first->payload);
+    ASSERT_EQ(0, CountedValue::copy_count);
+    ASSERT_EQ(0, CountedValue::move_count);
+
+    // 已存在时不会构造
+    ASSERT_FALSE(map.try_emplace(3, 0, "e").second);
+    ASSERT_EQ("d", map.find(3)->payload);
+    ASSERT_EQ(3u, map.size());
+}
+
+TEST(sgement_map, modify_in_place) {
+    SegmentMap<int, CountedValue> map(1000, 4);
+    map.emplace(5, "x");
+    CountedValue::reset();
+
+    ASSERT_TRUE(map.modify(5, [](CountedValue &v) { v.payload += "y"; }));
+    ASSERT_FALSE(map.modify(6, [](CountedValue &v) { v.payload += "y"; }));
+    ASSERT_EQ("xy", map.find(5)->payload);
+    ASSERT_EQ(0, CountedValue::copy_count + CountedValue::move_count);
+}
+
+TEST(sgement_map, insert_or_replace_returns_evicted) {
+    SegmentMap<int, CountedValue> map(100, 2);
+
+    // 填满表, 找到一个所有阶都冲突的key
+    int key = 1;
+    for (; map.insert_new(CountedValue(key, "old")).first != map.end(); ++key) {
+    }
+    ASSERT_TRUE(map.find(key) == map.end());
+    size_t size = map.size();
+
+    CountedValue replaced;
+    std::pair<SegmentMap<int, CountedValue>::iterator, bool> r =
+        map.insert_or_replace(CountedValue(key, "new"),
+                              [](const CountedValue &, const CountedValue &) { return true; },
+                              &replaced);
+    ASSERT_TRUE(r.second);
+    ASSERT_EQ("new", map.find(key)->payload);
+    ASSERT_EQ("old", replaced.payload);
+    ASSERT_NE(0, replaced.key);
+    ASSERT_TRUE(map.find(replaced.key) == map.end());
+    ASSERT_EQ(size, map.size());
+}
+
+struct Counter {
+    uint64_t id;
+    long hits;
+
+    Counter() : id(0), hits(0) {}
+
+    uint64_t getKey() const { return id; }
+    void setKey(uint64_t k) { id = k; }
+};
+
+TEST(sgement_map, infeasible_layout) {
+    // 1024/20 = 51, 小于51的素数只有15个, 不足以分出20阶
+    SegmentBucket buckets[SegmentMap<uint64_t, Counter>::MAX_SEGMENT_CNT];
+    ASSERT_EQ(0u, init_segment_buckets(1024, 20, buckets));
+    ASSERT_EQ(0u, init_segment_buckets(1024, 0, buckets));
+    ASSERT_NE(0u, init_segment_buckets(1024, 8, buckets));
+    ASSERT_EQ(0u, find_perv_prime(0));
+
+    typedef SegmentMap<uint64_t, Counter> Map;
+    typedef SegmentSet<uint64_t, 0, Counter> RecordSet;
+    typedef CompactSegmentSet<uint64_t, 0> KeySet;
+    typedef SnapshotSegmentMap<uint64_t, Counter> SnapshotMap;
+    typedef ShardedSegmentMap<uint64_t, Counter> ShardedMap;
+    ASSERT_THROW(Map(1024, 20), std::invalid_argument);
+    ASSERT_THROW(Map(1024, 0), std::invalid_argument);
+    ASSERT_THROW(Map(1024, Map::MAX_SEGMENT_CNT + 1), std::invalid_argument);
+    ASSERT_THROW(RecordSet(1024, 20), std::invalid_argument);
+    ASSERT_THROW(KeySet(1024, 20), std::invalid_argument);
+    ASSERT_THROW(SnapshotMap(1024, 20), std::invalid_argument);
+    // 每个分片只有1024个slot
+    ASSERT_THROW(ShardedMap(4096, 20, 4), std::invalid_argument);
+
+    Map map(1024, 8);
+    ASSERT_EQ(0, map.init());
+    ASSERT_GT(map.max_size(), 0u);
+}
+
+TEST(sgement_map, upsert_counts) {
+    SegmentMap<uint64_t, Counter> map(10000, 8);
+
+    for (int round = 0; round < 3; ++round) {
+        for (uint64_t k = 1; k <= 100; ++k) {
+            map.upsert(k, [](Counter &c) { c.hits = 1; },
+                       [](Counter &c) { ++c.hits; });
+        }
+    }
+    ASSERT_EQ(100u, map.size());
+    ASSERT_EQ(3, map.find(42)->hits);
+
+    ASSERT_TRUE(map.upsert_add(42, &Counter::hits, 10L).first != map.end());
+    ASSERT_TRUE(map.upsert_add(1000, &Counter::hits, 5L).second);
+    ASSERT_EQ(13, map.find(42)->hits);
+    ASSERT_EQ(5, map.find(1000)->hits);
+
+    // 删除后重新插入的元素会被重新初始化
+    map.find(7)->hits = 99;
+    map.erase(7);
+    map.upsert_add(7, &Counter::hits, 1L);
+    ASSERT_EQ(1, map.find(7)->hits);
+
+    // init_fn抛出异常时不会留下占用的slot
+    size_t size = map.size();
+    ASSERT_THROW(map.upsert(2000, [](Counter &) { throw std::runtime_error("init"); },
+                            [](Counter &c) { ++c.hits; }),
+                 std::runtime_error);
+    ASSERT_EQ(size, map.size());
+    ASSERT_TRUE(map.find(2000) == map.end());
+    ASSERT_TRUE(map.upsert_add(2000, &Counter::hits, 1L).second);
+}
+
+TEST(sgement_map, upsert_add_atomic) {
+    SegmentMap<uint64_t, Counter> map(10000, 8);
+
+    // 删除后的空slot保留了旧的计数, 重新占用时不能带上旧值
+    for (uint64_t k = 1; k <= 200; ++k) map.upsert_add(k, &Counter::hits, 1000L);
+    for (uint64_t k = 1; k <= 200; ++k) map.erase(k);
+    ASSERT_TRUE(map.empty());
+
+    // 所有线程按相同顺序增加相同的key, 大量竞争同一个空slot
+    const int threads = 4, rounds = 50;
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.push_back(std::thread([&map, rounds]() {
+            for (int r = 0; r < rounds; ++r) {
+                for (uint64_t k = 1; k <= 500; ++k)
+                    map.upsert_add_atomic(k, &Counter::id, &Counter::hits, (long)k);
+            }
+        }));
+    }
+    for (size_t t = 0; t < workers.size(); ++t) workers[t].join();
+
+    ASSERT_EQ(500u, map.size());
+    for (uint64_t k = 1; k <= 500; ++k) {
+        ASSERT_EQ((long)k * threads * rounds, map.find(k)->hits) << k;
+    }
+
+    ASSERT_FALSE(map.upsert_add_atomic(1, &Counter::id, &Counter::hits, 1L).second);
+    ASSERT_TRUE(map.upsert_add_atomic(0, &Counter::id, &Counter::hits, 1L).first == map.end());
+}
+
+TEST(sgement_map, upsert_batch) {
+    SegmentMap<uint64_t, Counter> map(10000, 8);
+
+    std::vector<std::pair<uint64_t, long> > stream;
+    for (uint64_t i = 0; i < 1000; ++i) {
+        stream.push_back(std::make_pair(i % 50 + 1, 2L));
+    }
+
+    size_t failed = map.upsert_batch(
+        stream.begin(), stream.end(),
+        [](const std::pair<uint64_t, long> &e) { return e.first; },
+        [](Counter &c, const std::pair<uint64_t, long> &e) { c.hits = e.second; },
+        [](Counter &c, const std::pair<uint64_t, long> &e) { c.hits += e.second; });
+
+    ASSERT_EQ(0u, failed);
+    ASSERT_EQ(50u, map.size());
+    for (uint64_t k = 1; k <= 50; ++k) {
+        ASSERT_EQ(40, map.find(k)->hits);
+    }
+}
+
+TEST(sgement_map, stage_of) {
+    SegmentMap<uint64_t, Counter> map(1000, 5);
+
+    ASSERT_EQ(0u, map.stage_of(0));
+    ASSERT_EQ(map.stage() - 1, map.stage_of(map.max_size() - 1));
+
+    // 第一个元素一定在第一阶
+    std::pair<SegmentMap<uint64_t, Counter>::iterator, bool> r = map.upsert_add(3, &Counter::hits, 1L);
+    ASSERT_EQ(0u, map.stage_of(r.first.index()));
+
+    size_t last = 0;
+    for (size_t i = 0; i < map.max_size(); ++i) {
+        ASSERT_GE(map.stage_of(i), last);
+        last = map.stage_of(i);
+    }
+}
+
+typedef SegmentMap<uint64_t, Counter, 0, segment_hash::identity, segment_dirty::DirtyBitmap>
+    TrackedCounterMap;
+
+TEST(sgement_map, policies_do_not_grow_map) {
+    struct CoreLayout {
+        SegmentBucket buckets[SegmentMap<uint64_t, Counter>::MAX_SEGMENT_CNT];
+        size_t stage, map_size;
+        bool is_init;
+        size_t max_size, used_size;
+        Counter *slots;
+    };
+    ASSERT_EQ(sizeof(CoreLayout), sizeof(SegmentMap<uint64_t, Counter>));
+    ASSERT_GT(sizeof(TrackedCounterMap), sizeof(SegmentMap<uint64_t, Counter>));
+}
+
+TEST(sgement_map, dirty_tracking_export) {
+    typedef SegmentMap<uint64_t, Counter> Map;
+    TrackedCounterMap master(10000, 8);
+    Map replica(10000, 8);
+    for (uint64_t k = 1; k <= 1000; ++k) master.upsert_add(k, &Counter::hits, 1L);
+
+    // 开启时全部为脏, 第一次导出为全量
+    master.enable_dirty_tracking(64);
+    size_t full = master.export_dirty([&replica](size_t first, const Counter *slots, size_t n) {
+        replica.apply_slots(first, slots, n);
+    });
+    ASSERT_EQ((master.max_size() + 63) / 64, full);
+    ASSERT_EQ(1000u, replica.size());
+    ASSERT_EQ(0u, master.export_dirty([](size_t, const Counter *, size_t) {}));
+
+    // 增量只包含修改过的chunk, 删除也会同步
+    master.upsert_add(5, &Counter::hits, 10L);
+    master.erase(6);
+    master.insert_new(Counter());
+    Counter c;
+    c.id = 2000;
+    master.insert_or_update(c);
+    size_t delta = master.export_dirty([&replica](size_t first, const Counter *slots, size_t n) {
+        replica.apply_slots(first, slots, n);
+    });
+    ASSERT_GE(delta, 1u);
+    ASSERT_LE(delta, 3u);
+    ASSERT_EQ(master.size(), replica.size());
+    ASSERT_EQ(11, replica.find(5)->hits);
+    ASSERT_TRUE(replica.find(6) == replica.end());
+    ASSERT_TRUE(replica.find(2000) != replica.end());
+
+    for (TrackedCounterMap::iterator it = master.begin(); it != master.end(); ++it) {
+        ASSERT_EQ(it->hits, replica.find(it->id)->hits);
+    }
+}
+
+TEST(sgement_map, dirty_tracking_delta_file) {
+    typedef SegmentMap<uint64_t, Counter> Map;
+    TrackedCounterMap master(5000, 8);
+    Map replica(5000, 8), other(6000, 8);
+    master.enable_dirty_tracking(16);
+    for (uint64_t k = 1; k <= 300; ++k) master.upsert_add(k, &Counter::hits, (long)k);
+
+    FILE *fp = tmpfile();
+    ASSERT_TRUE(fp != NULL);
+    ASSERT_GT(segment_dirty::write_delta(master, fp), 0);
+    master.erase(10);
+    master.modify(20, [](Counter &v) { v.hits = -1; });
+    ASSERT_LE(segment_dirty::write_delta(master, fp), 2);
+
+    rewind(fp);
+    ASSERT_GT(segment_dirty::read_delta(replica, fp), 0);
+    ASSERT_GE(segment_dirty::read_delta(replica, fp), 1);
+    ASSERT_EQ(299u, replica.size());
+    ASSERT_TRUE(replica.find(10) == replica.end());
+    ASSERT_EQ(-1, replica.find(20)->hits);
+    ASSERT_EQ(300, replica.find(300)->hits);
+
+    // 布局不同的map不能应用, 包括Hash策略不同
+    rewind(fp);
+    ASSERT_EQ(-1, segment_dirty::read_delta(other, fp));
+    SegmentMap<uint64_t, Counter, 0, segment_hash::murmur> mixed(5000, 8);
+    rewind(fp);
+    ASSERT_EQ(-1, segment_dirty::read_delta(mixed, fp));
+    ASSERT_TRUE(mixed.empty());
+
+    // 截断的文件不修改map
+    rewind(fp);
+    std::vector<char> bytes(sizeof(segment_dirty::DeltaHeader) + 4096);
+    size_t n = fread(bytes.data(), 1, bytes.size(), fp);
+    ASSERT_EQ(bytes.size(), n);
+    FILE *cut = tmpfile();
+    ASSERT_TRUE(cut != NULL);
+    ASSERT_EQ(n, fwrite(bytes.data(), 1, n, cut));
+    rewind(cut);
+    Map fresh(5000, 8);
+    ASSERT_EQ(-1, segment_dirty::read_delta(fresh, cut));
+    ASSERT_TRUE(fresh.empty());
+    fclose(cut);
+    fclose(fp);
+}
+
+TEST(sgement_map, tiered_storage) {
+    typedef SegmentMap<uint64_t, Counter, 0, segment_hash::identity,
+                       segment_policy::no_tracking, segment_tier::TieredStorage>
+        Map;
+    Map map(100000, 10);
+    char path[] = "/tmp/segment_tier_XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+
+    ASSERT_EQ(0, map.init_tiered(path, 4));
+    ASSERT_TRUE(map.tiered());
+    ASSERT_GE(map.hot_size(), map.slot_index(0, 4));
+    ASSERT_LT(map.hot_size(), map.max_size());
+
+    for (uint64_t k = 1; k <= 50000; ++k) map.upsert_add(k, &Counter::hits, (long)k);
+    size_t cold = 0;
+    for (Map::iterator it = map.begin(); it != map.end(); ++it) {
+        ASSERT_EQ((long)it->id, it->hits);
+        cold += it.index() >= map.hot_size();
+    }
+    ASSERT_GT(cold, 0u);
+    ASSERT_LT(cold, 50000u / 4);
+    ASSERT_TRUE(map.erase(77));
+    ASSERT_TRUE(map.find(77) == map.end());
+    ASSERT_EQ(49999u, map.size());
+
+    struct stat st;
+    ASSERT_EQ(0, stat(path, &st));
+    ASSERT_GE((size_t)st.st_size, (map.max_size() - map.hot_size()) * sizeof(Counter));
+
+    // 重新使用普通内存
+    map.init();
+    ASSERT_FALSE(map.tiered());
+    ASSERT_EQ(map.max_size(), map.hot_size());
+    ASSERT_TRUE(map.upsert_add(1, &Counter::hits, 1L).second);
+    unlink(path);
+
+    // 无法创建文件时退回普通内存
+    ASSERT_EQ(-1, map.init_tiered("/nonexistent/dir/cold", 3));
+    ASSERT_FALSE(map.tiered());
+    ASSERT_TRUE(map.upsert_add(1, &Counter::hits, 1L).second);
+}
+
+TEST(sgement_map, freeze) {
+    SegmentMap<uint64_t, Counter> map(50000, 20);
+    std::mt19937_64 rng(7);
+    std::vector<uint64_t> keys;
+    for (size_t i = 0; i < 30000; ++i) {
+        uint64_t k = rng() | 1;
+        if (map.upsert_add(k, &Counter::hits, (long)i).second) keys.push_back(k);
+    }
+    // 顺序key也能构建
+    for (uint64_t k = 2; k <= 10000; k += 2) {
+        if (map.upsert_add(k, &Counter::hits, (long)k).second) keys.push_back(k);
+    }
+
+    FrozenSegmentMap<uint64_t, Counter> frozen = freeze(map);
+    ASSERT_EQ(map.size(), frozen.size());
+    // 没有空slot, pilot每个key约1字节
+    ASSERT_LE(frozen.memory_size(), frozen.size() * (sizeof(Counter) + 1) + sizeof(uint32_t));
+    for (size_t i = 0; i < keys.size(); ++i) {
+        FrozenSegmentMap<uint64_t, Counter>::const_iterator it = frozen.find(keys[i]);
+        ASSERT_TRUE(it != frozen.end());
+        ASSERT_EQ(map.find(keys[i])->hits, it->hits);
+    }
+    for (uint64_t k = 10002; k < 20000; k += 2) ASSERT_FALSE(frozen.contains(k));
+    ASSERT_FALSE(frozen.contains(0));
+
+    size_t n = 0;
+    for (FrozenSegmentMap<uint64_t, Counter>::const_iterator it = frozen.begin(); it != frozen.end(); ++it)
+        n += map.count(it->id);
+    ASSERT_EQ(map.size(), n);
+
+    SegmentMap<uint64_t, Counter> empty(1000, 4);
+    ASSERT_FALSE(freeze(empty).contains(1));
+}
+
+TEST(segment_set, freeze) {
+    CompactSegmentSet<uint64_t, 0, uint32_t> set(20000, 8);
+    for (uint64_t k = 1; k <= 10000; ++k) set.insert(k * 3);
+
+    FrozenSegmentSet<uint64_t, uint32_t> frozen = freeze(set);
+    ASSERT_TRUE(frozen.valid());
+    ASSERT_EQ(set.size(), frozen.size());
+    for (uint64_t k = 1; k <= 30000; ++k) ASSERT_EQ(set.contains(k), frozen.contains(k)) << k;
+    ASSERT_FALSE(frozen.contains(3 + (1ULL << 32)));
+
+    SegmentSet<uint64_t, 0, Counter> records(1000, 4);
+    Counter c;
+    c.id = 42;
+    c.hits = 7;
+    records.insert(c);
+    FrozenSegmentMap<uint64_t, Counter> frozen_records = freeze(records);
+    ASSERT_TRUE(frozen_records.valid());
+    ASSERT_EQ(7, frozen_records.find(42)->hits);
+
+    // 有重复的key时构建失败, 返回空表
+    std::vector<uint64_t> dup(100, 5);
+    dup.push_back(6);
+    FrozenSegmentSet<uint64_t> bad(dup.begin(), dup.end());
+    ASSERT_FALSE(bad.valid());
+    ASSERT_TRUE(bad.empty());
+    ASSERT_FALSE(bad.contains(5));
+    ASSERT_FALSE(bad.contains(6));
+
+    std::vector<Counter> dup_records(2, c);
+    FrozenSegmentMap<uint64_t, Counter> bad_records(dup_records.begin(), dup_records.end());
+    ASSERT_FALSE(bad_records.valid());
+    ASSERT_TRUE(bad_records.find(42) == bad_records.end());
+}
+
+TEST(sgement_map, snapshot_stable_view) {
+    typedef SnapshotSegmentMap<uint64_t, Counter> Map;
+    Map map(10000, 8, 64);
+    Counter c;
+    for (uint64_t k = 1; k <= 1000; ++k) {
+        c.id = k;
+        c.hits = 1;
+        ASSERT_TRUE(map.insert_new(c));
+    }
+
+    Map::Snapshot s1 = map.snapshot();
+    for (uint64_t k = 1; k <= 1000; ++k) map.modify(k, [](Counter &v) { v.hits = 2; });
+    map.erase(10);
+    c.id = 5000;
+    ASSERT_TRUE(map.insert_or_update(c).second);
+    Map::Snapshot s2 = map.snapshot();
+    map.erase(20);
+
+    ASSERT_EQ(1000u, s1.size());
+    ASSERT_EQ(1, s1.find(10)->hits);
+    ASSERT_TRUE(s1.find(5000) == NULL);
+    s1.for_each([](const Counter &v) { ASSERT_EQ(1, v.hits); });
+
+    ASSERT_EQ(1000u, s2.size());
+    ASSERT_TRUE(s2.find(10) == NULL);
+    ASSERT_EQ(2, s2.find(20)->hits);
+    ASSERT_EQ(1, s2.find(5000)->hits);
+
+    ASSERT_EQ(999u, map.size());
+    ASSERT_TRUE(map.find(20) == NULL);
+    ASSERT_EQ(2, map.find(30)->hits);
+
+    s1.release();
+    Map::Snapshot s3 = std::move(s2);
+    ASSERT_FALSE(s2.valid());
+    ASSERT_EQ(1000u, s3.size());
+}
+
+TEST(sgement_map, snapshot_concurrent_writer) {
+    typedef SnapshotSegmentMap<uint64_t, Counter> Map;
+    const uint64_t N = 2000;
+    Map map(4000, 8, 32);
+    Counter c;
+    for (uint64_t k = 1; k <= N; ++k) {
+        c.id = k;
+        map.insert_new(c);
+    }
+
+    // 每一轮按key顺序把hits设置为轮数, 一致的快照中hits按key不增且最多相差1
+    std::atomic<bool> stop(false);
+    std::thread writer([&map, &stop, N]() {
+        for (long round = 1; !stop.load(); ++round) {
+            for (uint64_t k = 1; k <= N; ++k)
+                map.modify(k, [round](Counter &v) { v.hits = round; });
+        }
+    });
+
+    for (int i = 0; i < 200; ++i) {
+        Map::Snapshot s = map.snapshot();
+        long prev = s.find(1)->hits;
+        long last = prev;
+        for (uint64_t k = 2; k <= N; ++k) {
+            long h = s.find(k)->hits;
+            ASSERT_LE(h, prev) << "snapshot " << i << " key " << k;
+            prev = h;
+        }
+        ASSERT_LE(last - prev, 1);
+    }
+    stop = true;
+    writer.join();
+}
+
+TEST(sgement_map, sharded_front_end) {
+    typedef ShardedSegmentMap<uint64_t, Counter> Map;
+    Map map(40000, 8, 4);
+    map.start();
+
+    // 顺序key在分片之间均匀分布
+    size_t per_shard[4] = {0};
+    for (uint64_t k = 1; k <= 10000; ++k) ++per_shard[map.shard_of(k)];
+    for (size_t s = 0; s < 4; ++s) ASSERT_NEAR(2500.0, (double)per_shard[s], 250.0);
+
+    std::vector<std::thread> producers;
+    for (uint64_t t = 0; t < 2; ++t) {
+        producers.push_back(std::thread([&map, t]() {
+            Map::Producer *p = map.connect();
+            Counter c;
+            for (uint64_t k = t * 5000 + 1; k <= (t + 1) * 5000; ++k) {
+                c.id = k;
+                c.hits = (long)k;
+                p->insert_new(c);
+            }
+            for (uint64_t k = t * 5000 + 1; k <= (t + 1) * 5000; k += 10) p->erase(k);
+            p->sync();
+        }));
+    }
+    for (size_t i = 0; i < producers.size(); ++i) producers[i].join();
+
+    ASSERT_EQ(9000u, map.size());
+    ASSERT_EQ(0u, map.failed());
+
+    Map::Producer *p = map.connect();
+    Map::Result r1, r2;
+    p->find(42, &r1);
+    p->find(41, &r2);
+    r1.wait();
+    r2.wait();
+    ASSERT_TRUE(r1.found);
+    ASSERT_EQ(42, r1.value.hits);
+    ASSERT_FALSE(r2.found);
+
+    size_t n = 0;
+    long sum = 0;
+    map.for_each([&n, &sum](const Counter &c) {
+        ++n;
+        sum += c.hits;
+    });
+    ASSERT_EQ(9000u, n);
+    // 1..10000 减去被删除的 1, 11, 21, ...
+    ASSERT_EQ(50005000L - 4996000L, sum);
+
+    // 多个线程同时遍历
+    std::atomic<size_t> total(0);
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 3; ++t) {
+        readers.push_back(std::thread([&map, &total]() {
+            map.for_each([&total](const Counter &) { total.fetch_add(1); });
+        }));
+    }
+    for (size_t i = 0; i < readers.size(); ++i) readers[i].join();
+    ASSERT_EQ(3u * 9000u, total.load());
+
+    // 停止后在调用线程中遍历, 启动前没有分片
+    map.stop();
+    n = 0;
+    map.for_each([&n](const Counter &) { ++n; });
+    ASSERT_EQ(9000u, n);
+
+    Map idle(40000, 8, 4);
+    idle.for_each([&n](const Counter &) { ++n; });
+    ASSERT_EQ(9000u, n);
+}
+
+// 插入keys, 返回插入失败数量和平均探测深度
+template <typename Map>
+std::pair<size_t, double> probe_depth(const std::vector<uint64_t> &keys, size_t slots) {
+    Map map(slots, 20);
+    size_t failed = 0, depth = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        Counter c;
+        c.id = keys[i];
+        typename Map::iterator it = map.insert_new(c).first;
+        if (it == map.end())
+            ++failed;
+        else
+            depth += map.stage_of(it.index()) + 1;
+    }
+    return std::make_pair(failed, (double)depth / (keys.size() - failed));
+}
+
+TEST(sgement_map, hash_policy_utilization) {
+    typedef SegmentMap<uint64_t, Counter> IdentityMap;
+    typedef SegmentMap<uint64_t, Counter, 0, segment_hash::murmur> MurmurMap;
+    typedef SegmentMap<uint64_t, Counter, 0, segment_hash::seeded> SeededMap;
+    const size_t slots = 100000, n = 80000;
+
+    std::vector<std::vector<uint64_t> > sets(4);
+    std::mt19937_64 rng(3);
+    for (uint64_t i = 1; i <= n; ++i) {
+        sets[0].push_back(i);                                  // 顺序
+        sets[1].push_back(i * 1024);                           // 等间隔
+        sets[2].push_back(((i % 16) << 40) | (i / 16 + 1));    // 分片前缀
+        sets[3].push_back(rng() | 1);                          // 随机
+    }
+
+    for (size_t i = 0; i < sets.size(); ++i) {
+        std::pair<size_t, double> id = probe_depth<IdentityMap>(sets[i], slots);
+        std::pair<size_t, double> mm = probe_depth<MurmurMap>(sets[i], slots);
+        std::pair<size_t, double> sd = probe_depth<SeededMap>(sets[i], slots);
+        ASSERT_EQ(0u, id.first) << i;
+        ASSERT_EQ(0u, mm.first) << i;
+        ASSERT_EQ(0u, sd.first) << i;
+        // 80%装载, 20阶时平均探测次数约8.5
+        ASSERT_LT(id.second, 9.0) << i;
+        ASSERT_LT(mm.second, 9.0) << i;
+        ASSERT_LT(sd.second, 9.0) << i;
+        // 混合后的分布与随机key相同
+        ASSERT_NEAR(mm.second, sd.second, 0.1) << i;
+    }
+}
+
+TEST(sgement_map, hash_policy_stage_aligned_keys) {
+    typedef SegmentMap<uint64_t, Counter> IdentityMap;
+    typedef SegmentMap<uint64_t, Counter, 0, segment_hash::murmur> MurmurMap;
+    typedef SegmentMap<uint64_t, Counter, 0, segment_hash::seeded> SeededMap;
+    const size_t slots = 100000;
+
+    // 间隔为第一阶的大小, 直接取模时第一阶只能存储一个元素
+    IdentityMap layout(slots, 20);
+    const uint64_t stride = layout.slot_index(0, 1);  // 第二阶的偏移即第一阶的大小
+    std::vector<uint64_t> keys;
+    for (uint64_t i = 1; i <= 60000; ++i) keys.push_back(i * stride);
+
+    std::pair<size_t, double> id = probe_depth<IdentityMap>(keys, slots);
+    std::pair<size_t, double> mm = probe_depth<MurmurMap>(keys, slots);
+    std::pair<size_t, double> sd = probe_depth<SeededMap>(keys, slots);
+    ASSERT_GT(id.second, mm.second + 0.5);
+    ASSERT_GT(id.second, sd.second + 0.5);
+    ASSERT_EQ(0u, mm.first);
+    ASSERT_EQ(0u, sd.first);
+
+    // 查找和删除使用相同的变换
+    MurmurMap map(slots, 20);
+    Counter c;
+    c.id = keys[7];
+    map.insert_new(c);
+    ASSERT_TRUE(map.find(keys[7]) != map.end());
+    ASSERT_TRUE(map.erase(keys[7]));
+    ASSERT_TRUE(map.find(keys[7]) == map.end());
+}
+
+TEST(segment_set, hash_policy) {
+    typedef SegmentSet<uint64_t, 0, Counter> IdentityRecords;
+    typedef SegmentSet<uint64_t, 0, Counter, segment_set_get_key<uint64_t, Counter>,
+                       segment_hash::murmur>
+        MurmurRecords;
+    typedef CompactSegmentSet<uint64_t, 0, uint32_t> IdentityKeys;
+    typedef CompactSegmentSet<uint64_t, 0, uint32_t, segment_hash::murmur> MurmurKeys;
+    typedef CompactSegmentSet<uint64_t, 0, uint64_t, segment_hash::seeded> SeededKeys;
+    const size_t slots = 100000;
+
+    // 间隔为第一阶的大小, 直接取模时第一阶只能存储一个元素
+    IdentityKeys id_keys(slots, 20);
+    MurmurKeys mm_keys(slots, 20);
+    SeededKeys sd_keys(slots, 20);
+    IdentityRecords id_records(slots, 20);
+    MurmurRecords mm_records(slots, 20);
+    const uint64_t stride = SegmentMap<uint64_t, Counter>(slots, 20).slot_index(0, 1);
+
+    size_t first[5] = {0};
+    for (uint64_t i = 1; i <= 20000; ++i) {
+        const uint64_t k = i * stride;
+        Counter c;
+        c.id = k;
+        first[0] += id_keys.insert(k).first.index() < stride;
+        first[1] += mm_keys.insert(k).first.index() < stride;
+        first[2] += sd_keys.insert(k).first.index() < stride;
+        first[3] += id_records.insert(c).first.index() < stride;
+        first[4] += mm_records.insert(c).first.index() < stride;
+    }
+    ASSERT_EQ(1u, first[0]);
+    ASSERT_EQ(1u, first[3]);
+    ASSERT_GT(first[1], 1000u);
+    ASSERT_GT(first[2], 1000u);
+    ASSERT_GT(first[4], 1000u);
+
+    // 查找, SIMD查找和删除使用相同的变换
+    for (uint64_t i = 1; i <= 20000; ++i) {
+        const uint64_t k = i * stride;
+        ASSERT_EQ(mm_keys.contains(k), mm_keys.contains_simd(k)) << k;
+        ASSERT_EQ(sd_keys.contains(k), sd_keys.contains_simd(k)) << k;
+        ASSERT_FALSE(mm_keys.contains_simd(k + 1)) << k;
+    }
+    ASSERT_TRUE(mm_keys.contains(stride * 7));
+    ASSERT_TRUE(mm_records.find(stride * 7) != mm_records.end());
+    ASSERT_TRUE(mm_records.erase(stride * 7));
+    ASSERT_TRUE(mm_records.find(stride * 7) == mm_records.end());
+    ASSERT_TRUE(sd_keys.erase(stride * 7));
+    ASSERT_FALSE(sd_keys.contains(stride * 7));
+}
+
+TEST(segment_set, record_set) {
+    SegmentSet<uint64_t, 0, Counter> set(1000, 4);
+
+    Counter c;
+    c.id = 9;
+    ASSERT_TRUE(set.insert_new(c).second);
+    ASSERT_FALSE(set.insert_new(c).second);
+    ASSERT_EQ(1u, set.count(9));
+    ASSERT_TRUE(set.erase(9));
+    ASSERT_TRUE(set.empty());
+}
+
+TEST(segment_set, compact_key_set) {
+    // 元素就是key时使用只存储key的特化版本
+    SegmentSet<uint32_t, 0, uint32_t> set(10000, 8);
+    ASSERT_EQ(set.max_size() * sizeof(uint32_t), set.memory_size());
+
+    for (uint32_t k = 1; k <= 5000; ++k) ASSERT_TRUE(set.insert(k * 7).second);
+    ASSERT_FALSE(set.insert(7).second);
+    ASSERT_FALSE(set.insert(0).second);
+    ASSERT_EQ(5000u, set.size());
+    ASSERT_TRUE(set.contains(35));
+    ASSERT_FALSE(set.contains(36));
+
+    size_t n = 0;
+    for (SegmentSet<uint32_t, 0, uint32_t>::iterator it = set.begin(); it != set.end(); ++it) {
+        ASSERT_EQ(0u, *it % 7);
+        ++n;
+    }
+    ASSERT_EQ(5000u, n);
+
+    ASSERT_TRUE(set.erase(35));
+    ASSERT_FALSE(set.contains(35));
+    set.clear();
+    ASSERT_TRUE(set.begin() == set.end());
+}
+
+TEST(segment_set, compact_narrow_slot) {
+    CompactSegmentSet<uint64_t, 0, uint32_t> set(1000, 4);
+    ASSERT_EQ(set.max_size() * 4, set.memory_size());
+
+    ASSERT_TRUE(set.insert(0xffffffffull).second);
+    // 超出Slot范围
+    ASSERT_FALSE(set.insert(0x100000001ull).second);
+    ASSERT_FALSE(set.contains(0x100000001ull));
+    ASSERT_FALSE(set.contains(1));
+    ASSERT_TRUE(set.contains(0xffffffffull));
+}
+
+template <typename Set>
+void check_contains_batch(Set &set) {
+    std::mt19937_64 rng(7);
+    std::vector<uint64_t> keys;
+    for (size_t i = 0; i < 3000; ++i) {
+        uint64_t k = rng() % 20000;
+        set.insert(k);
+        keys.push_back(k);
+        keys.push_back(rng() % 20000);
+    }
+    keys.push_back(0);
+    keys.push_back(1ull << 40);
+
+    std::unique_ptr<bool[]> out(new bool[keys.size()]);
+    set.contains_batch(keys.data(), keys.size(), out.get());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        ASSERT_EQ(set.contains(keys[i]), out[i]) << keys[i];
+    }
+
+    // 数量不是SIMD宽度的整数倍
+    keys.push_back(keys[0]);
+    std::unique_ptr<bool[]> simd(new bool[keys.size()]);
+    set.contains_batch_simd(keys.data(), keys.size(), simd.get());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        ASSERT_EQ(set.contains(keys[i]), simd[i]) << keys[i];
+    }
+}
+
+TEST(segment_set, contains_batch) {
+    CompactSegmentSet<uint64_t, 0> wide(10000, 12);
+    check_contains_batch(wide);
+
+    CompactSegmentSet<uint64_t, 0, uint32_t> narrow(10000, 12);
+    check_contains_batch(narrow);
+
+    CompactSegmentSet<uint64_t, 0, uint16_t> tiny(10000, 12);
+    check_contains_batch(tiny);
+
+    CompactSegmentSet<uint64_t, 0, uint32_t, segment_hash::murmur> mixed(10000, 12);
+    check_contains_batch(mixed);
+}
+
+template <typename Set>
+void check_find_simd(Set &set) {
+    std::mt19937_64 rng(11);
+    for (size_t i = 0; i < 20000; ++i) set.insert(rng() % 50000);
+    set.erase(set.begin() != set.end() ? *set.begin() : 1);
+
+    for (uint64_t k = 0; k < 50000; ++k) {
+        ASSERT_TRUE(set.find(k) == set.find_simd(k)) << k;
+    }
+    ASSERT_FALSE(set.contains_simd(0));
+}
+
+TEST(segment_set, find_simd) {
+    // 阶数不是SIMD宽度的整数倍
+    for (int stage = 1; stage <= 19; stage += 6) {
+        CompactSegmentSet<uint64_t, 0, uint32_t> narrow(24000, stage);
+        check_find_simd(narrow);
+    }
+
+    CompactSegmentSet<uint32_t, 0> key32(24000, 20);
+    check_find_simd(key32);
+
+    CompactSegmentSet<uint64_t, 0> wide(24000, 20);
+    check_find_simd(wide);
+}
+
+TEST(segment_simd, probe32) {
+    const size_t stage = 13;
+    SegmentBucket buckets[stage];
+    size_t max_size = init_segment_buckets(5000, stage, buckets);
+    segment_simd::StageVectors<16> vec;
+    vec.init(buckets, stage);
+
+    // key k 放在第 k % stage 阶
+    std::vector<uint32_t> slots(max_size, 0);
+    for (uint32_t k = 1; k < 300; ++k) {
+        size_t s = k % stage;
+        slots[k % buckets[s].size + buckets[s].offset] = k;
+    }
+
+    for (uint32_t k = 1; k < 600; ++k) {
+        int expect = -1;
+        for (size_t i = 0; expect < 0 && i < stage; ++i) {
+            if (slots[k % buckets[i].size + buckets[i].offset] == k) expect = (int)i;
+        }
+#ifdef SEGMENT_SIMD_X86
+        if (segment_simd::cpu_level() >= segment_simd::LEVEL_AVX2) {
+            ASSERT_EQ(expect, segment_simd::probe32_avx2(slots.data(), vec.magic, vec.size,
+                                                         vec.offset, stage, k, k)) << k;
+        }
+        if (segment_simd::cpu_level() >= segment_simd::LEVEL_AVX512) {
+            ASSERT_EQ(expect, segment_simd::probe32_avx512(slots.data(), vec.magic, vec.size,
+                                                           vec.offset, stage, k, k)) << k;
+        }
+#endif
+    }
+
+#ifdef SEGMENT_SIMD_X86
+    // 批量探测, 每组中第一个lane不参与查找
+    for (uint32_t k = 1; k < 600; k += 8) {
+        uint32_t keys[8];
+        unsigned expect = 0;
+        for (uint32_t j = 0; j < 8; ++j) {
+            keys[j] = k + j;
+            for (size_t i = 0; j > 0 && i < stage; ++i) {
+                if (slots[keys[j] % buckets[i].size + buckets[i].offset] == keys[j])
+                    expect |= 1u << j;
+            }
+        }
+        if (segment_simd::cpu_level() >= segment_simd::LEVEL_AVX2) {
+            ASSERT_EQ(expect & 0xf, segment_simd::batch32_avx2(slots.data(), vec.magic, vec.size,
+                                                               vec.offset, stage, keys, keys, 0xe))
+                << k;
+        }
+        if (segment_simd::cpu_level() >= segment_simd::LEVEL_AVX512) {
+            ASSERT_EQ(expect, segment_simd::batch32_avx512(slots.data(), vec.magic, vec.size,
+                                                           vec.offset, stage, keys, keys, 0xfe))
+                << k;
+        }
+    }
+#endif
+}
@@ -0,0 +1,350 @@
+//
+// SegmentMap 容量规划工具
+//
+// 使用操作trace或者生成的key分布, 对多组(slot_count, segment_count)进行回放,
+// 输出利用率, 插入失败数, 探测深度分布, ns/op,
+// 并推荐满足目标利用率的最小布局.
+//
+// trace文件格式, 每行一个操作:
+//   i <key>   insert_new
+//   u <key>   insert_or_update
+//   f <key>   find
+//   e <key>   erase
+//
+// usage:
+//   segment_planner --trace=ops.txt --target=0.85
+//   segment_planner --dist=zipf --keys=1000000 --ops=5000000 --stages=8,20,40
+//   segment_planner --dist=stride --stride=1024 --slots=1100000,1200000
+//   segment_planner --dist=stride --hash=identity,murmur,seeded
+//
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "../src/segment_map.hpp"
+
+namespace {
+
+struct PlanValue {
+    uint64_t key;
+
+    PlanValue() : key(0) {}
+    explicit PlanValue(uint64_t k) : key(k) {}
+
+    uint64_t getKey() const { return key; }
+    void setKey(uint64_t k) { key = k; }
+};
+
+typedef SegmentMap<uint64_t, PlanValue> PlanMap;
+typedef SegmentMap<uint64_t, PlanValue, 0, segment_hash::murmur> MurmurPlanMap;
+typedef SegmentMap<uint64_t, PlanValue, 0, segment_hash::seeded> SeededPlanMap;
+
+struct Op {
+    char type;
+    uint64_t key;
+};
+
+struct Options {
+    std::string trace;
+    std::string dist;
+    size_t keys;
+    size_t ops;
+    uint64_t stride;
+    double zipf_s;
+    double target;
+    std::vector<size_t> slots;
+    std::vector<size_t> stages;
+    std::vector<std::string> hashes;
+
+    Options()
+        : dist("uniform"), keys(1000000), ops(0), stride(1024), zipf_s(0.99),
+          target(0.85) {}
+};
+
+struct Result {
+    std::string hash;
+    size_t slots;
+    size_t stage;
+    size_t max_size;
+    size_t used;
+    size_t insert_failed;
+    size_t found;
+    double ns_per_op;
+    std::vector<size_t> depth;  // 每一阶的元素数量
+};
+
+std::vector<size_t> parse_list(const char *s) {
+    std::vector<size_t> v;
+    while (*s) {
+        char *end = NULL;
+        v.push_back(strtoull(s, &end, 10));
+        if (*end != ',') break;
+        s = end + 1;
+    }
+    return v;
+}
+
+std::vector<std::string> parse_names(const char *s) {
+    std::vector<std::string> v;
+    while (*s) {
+        const char *end = strchr(s, ',');
+        if (!end) end = s + strlen(s);
+        v.push_back(std::string(s, end - s));
+        if (!*end) break;
+        s = end + 1;
+    }
+    return v;
+}
+
+bool parse_options(int argc, char **argv, Options &o) {
+    for (int i = 1; i < argc; ++i) {
+        const char *a = argv[i];
+        const char *eq = strchr(a, '=');
+        if (!eq) return false;
+
+        std::string name(a, eq - a);
+        const char *val = eq + 1;
+        if (name == "--trace") o.trace = val;
+        else if (name == "--dist") o.dist = val;
+        else if (name == "--keys") o.keys = strtoull(val, NULL, 10);
+        else if (name == "--ops") o.ops = strtoull(val, NULL, 10);
+        else if (name == "--stride") o.stride = strtoull(val, NULL, 10);
+        else if (name == "--zipf") o.zipf_s = atof(val);
+        else if (name == "--target") o.target = atof(val);
+        else if (name == "--slots") o.slots = parse_list(val);
+        else if (name == "--stages") o.stages = parse_list(val);
+        else if (name == "--hash") o.hashes = parse_names(val);
+        else return false;
+    }
+    for (size_t i = 0; i < o.hashes.size(); ++i) {
+        if (o.hashes[i] != "identity" && o.hashes[i] != "murmur" && o.hashes[i] != "seeded")
+            return false;
+    }
+    if (o.dist != "uniform" && o.dist != "seq" && o.dist != "stride" && o.dist != "zipf")
+        return false;
+    return o.keys > 0;
+}
+
+bool load_trace(const std::string &path, std::vector<Op> &ops) {
+    std::ifstream in(path.c_str());
+    if (!in) return false;
+
+    Op op;
+    while (in >> op.type >> op.key) {
+        if (!strchr("iufe", op.type)) return false;
+        ops.push_back(op);
+    }
+    return in.eof();
+}
+
+// 先插入所有key, 再按分布生成find
+void gen_trace(const Options &o, std::vector<Op> &ops) {
+    std::mt19937_64 rng(42);
+    std::vector<uint64_t> keys(o.keys);
+    for (size_t i = 0; i < o.keys; ++i) {
+        if (o.dist == "seq" || o.dist == "zipf")
+            keys[i] = i + 1;
+        else if (o.dist == "stride")
+            keys[i] = (i + 1) * o.stride;
+        else
+            keys[i] = (rng() >> 1) | 1;
+    }
+
+    for (size_t i = 0; i < keys.size(); ++i) {
+        Op op = {'i', keys[i]};
+        ops.push_back(op);
+    }
+
+    const size_t finds = o.ops ? o.ops : o.keys;
+    if (o.dist == "zipf") {
+        std::vector<double> cdf(o.keys);
+        double sum = 0;
+        for (size_t i = 0; i < o.keys; ++i) {
+            sum += 1.0 / pow((double)(i + 1), o.zipf_s);
+            cdf[i] = sum;
+        }
+        std::uniform_real_distribution<double> u(0, sum);
+        for (size_t i = 0; i < finds; ++i) {
+            size_t r = std::lower_bound(cdf.begin(), cdf.end(), u(rng)) - cdf.begin();
+            Op op = {'f', keys[std::min(r, o.keys - 1)]};
+            ops.push_back(op);
+        }
+    } else {
+        std::uniform_int_distribution<size_t> u(0, o.keys - 1);
+        for (size_t i = 0; i < finds; ++i) {
+            Op op = {'f', keys[u(rng)]};
+            ops.push_back(op);
+        }
+    }
+}
+
+template <typename Map>
+Result replay(const std::vector<Op> &ops, size_t slots, size_t stage) {
+    Map map(slots, (int)stage);
+    Result r;
+    r.slots = slots;
+    r.stage = stage;
+    r.insert_failed = 0;
+    r.found = 0;
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ops.size(); ++i) {
+        const Op &op = ops[i];
+        switch (op.type) {
+            case 'i':
+                if (map.insert_new(PlanValue(op.key)).first == map.end()) ++r.insert_failed;
+                break;
+            case 'u':
+                if (map.insert_or_update(PlanValue(op.key)).first == map.end()) ++r.insert_failed;
+                break;
+            case 'f':
+                r.found += map.count(op.key);
+                break;
+            case 'e':
+                map.erase(op.key);
+                break;
+        }
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    r.ns_per_op = ops.empty() ? 0 :
+        (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count() / ops.size();
+    r.max_size = map.max_size();
+    r.used = map.size();
+    r.depth.assign(stage, 0);
+    for (typename Map::iterator it = map.begin(); it != map.end(); ++it) {
+        ++r.depth[map.stage_of(it.index())];
+    }
+
+    return r;
+}
+
+Result replay(const std::vector<Op> &ops, const std::string &hash, size_t slots, size_t stage) {
+    Result r = hash == "murmur" ? replay<MurmurPlanMap>(ops, slots, stage)
+               : hash == "seeded" ? replay<SeededPlanMap>(ops, slots, stage)
+                                  : replay<PlanMap>(ops, slots, stage);
+    r.hash = hash;
+    return r;
+}
+
+// 平均探测次数, 和覆盖p99元素需要的阶数
+void depth_stats(const Result &r, double &avg, size_t &p99) {
+    size_t sum = 0, acc = 0;
+    p99 = 0;
+    for (size_t i = 0; i < r.depth.size(); ++i) sum += r.depth[i] * (i + 1);
+    avg = r.used ? (double)sum / r.used : 0;
+    for (size_t i = 0; i < r.depth.size(); ++i) {
+        acc += r.depth[i];
+        if (acc * 100 >= r.used * 99) {
+            p99 = i + 1;
+            break;
+        }
+    }
+}
+
+void usage() {
+    fprintf(stderr,
+            "usage: segment_planner [--trace=FILE | --dist=uniform|seq|stride|zipf]\n"
+            "                       [--keys=N] [--ops=N] [--stride=N] [--zipf=S]\n"
+            "                       [--slots=a,b,..] [--stages=a,b,..] [--target=0.85]\n"
+            "                       [--hash=identity,murmur,seeded]\n");
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    Options o;
+    if (!parse_options(argc, argv, o)) {
+        usage();
+        return 1;
+    }
+
+    std::vector<Op> ops;
+    if (!o.trace.empty()) {
+        if (!load_trace(o.trace, ops)) {
+            fprintf(stderr, "bad trace file: %s\n", o.trace.c_str());
+            return 1;
+        }
+    } else {
+        gen_trace(o, ops);
+    }
+
+    std::unordered_set<uint64_t> distinct;
+    for (size_t i = 0; i < ops.size(); ++i) {
+        if (ops[i].type == 'i' || ops[i].type == 'u') distinct.insert(ops[i].key);
+    }
+    if (distinct.empty()) {
+        fprintf(stderr, "trace has no insert\n");
+        return 1;
+    }
+
+    // 默认按照不同的期望利用率生成候选slot数量
+    if (o.slots.empty()) {
+        const double fills[] = {0.95, 0.9, 0.85, 0.8, 0.75, 0.7, 0.6, 0.5};
+        for (size_t i = 0; i < sizeof(fills) / sizeof(fills[0]); ++i)
+            o.slots.push_back((size_t)(distinct.size() / fills[i]));
+    }
+    if (o.hashes.empty()) o.hashes.push_back("identity");
+    if (o.stages.empty()) {
+        const size_t stages[] = {8, 12, 20, 30, 40, 50};
+        o.stages.assign(stages, stages + sizeof(stages) / sizeof(stages[0]));
+    }
+
+    printf("ops=%zu distinct_keys=%zu target_fill=%.2f\n\n", ops.size(), distinct.size(), o.target);
+    printf("%8s %10s %6s %10s %8s %8s %10s %8s %6s\n", "hash",
+           "slots", "stage", "max_size", "fill", "failed", "avg_probe", "p99_stg", "ns/op");
+
+    std::vector<Result> results;
+    SegmentBucket buckets[PlanMap::MAX_SEGMENT_CNT];
+    for (size_t h = 0; h < o.hashes.size(); ++h) {
+        for (size_t i = 0; i < o.slots.size(); ++i) {
+            for (size_t j = 0; j < o.stages.size(); ++j) {
+                // 跳过无法分出stage个素数大小阶的布局
+                size_t stage = o.stages[j];
+                if (stage == 0 || stage > PlanMap::MAX_SEGMENT_CNT ||
+                    init_segment_buckets(o.slots[i], stage, buckets) == 0)
+                    continue;
+
+                Result r = replay(ops, o.hashes[h], o.slots[i], stage);
+                double avg;
+                size_t p99;
+                depth_stats(r, avg, p99);
+                printf("%8s %10zu %6zu %10zu %8.4f %8zu %10.3f %8zu %6.1f\n", r.hash.c_str(),
+                       r.slots, r.stage, r.max_size, (double)r.used / r.max_size,
+                       r.insert_failed, avg, p99, r.ns_per_op);
+                results.push_back(r);
+            }
+        }
+    }
+
+    // 没有插入失败, 利用率满足目标, 内存最小, 阶数最少
+    const Result *best = NULL;
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result &r = results[i];
+        if (r.insert_failed || (double)r.used / r.max_size < o.target) continue;
+        if (!best || r.slots < best->slots ||
+            (r.slots == best->slots && r.stage < best->stage))
+            best = &r;
+    }
+
+    if (!best) {
+        printf("\nno layout meets target fill %.2f without insert failures\n", o.target);
+        return 2;
+    }
+
+    printf("\nrecommend: slot_count=%zu segment_count=%zu hash=%s (fill %.4f)\n", best->slots,
+           best->stage, best->hash.c_str(), (double)best->used / best->max_size);
+    printf("probe depth:");
+    for (size_t i = 0; i < best->depth.size(); ++i) printf(" %zu", best->depth[i]);
+    printf("\n");
+    return 0;
+}